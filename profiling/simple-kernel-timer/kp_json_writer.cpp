@@ -51,12 +51,25 @@
 #include <iostream>
 
 #include "kp_kernel_info.h"
+#include "kp_kernel_file.h"
 
 // clang-format on
 bool is_region(KernelPerformanceInfo const& kp) {
         return kp.getKernelType() == REGION;
 }
 
+bool is_fence(KernelPerformanceInfo const& kp) {
+        return kp.getKernelType() == FENCE;
+}
+
+bool is_deep_copy(KernelPerformanceInfo const& kp) {
+        return kp.getKernelType() == DEEP_COPY;
+}
+
+bool is_kernel(KernelPerformanceInfo const& kp) {
+        return !is_region(kp) && !is_fence(kp) && !is_deep_copy(kp);
+}
+
 inline std::string to_string(KernelExecutionType t) {
         switch (t) {
                 case PARALLEL_FOR:
@@ -67,43 +80,125 @@ inline std::string to_string(KernelExecutionType t) {
                         return "\"PARALLEL_SCAN\"";
                 case REGION:
                         return "\"REGION\"";
+                case FENCE:
+                        return "\"FENCE\"";
+                case DEEP_COPY:
+                        return "\"DEEP_COPY\"";
                 default:
                         throw t;
         }
 }
 
+// min/max and self time are NaN for files written before they were recorded
+inline void write_json_number(std::ostream& os, double value) {
+        if (std::isnan(value))
+                os << "null";
+        else
+                os << value;
+}
+
+// Quoted, with the characters JSON does not allow in a string escaped
+inline void write_json_string(std::ostream& os, const char* value) {
+        os << '"';
+        for (const char* c = value; *c != '\0'; c++) {
+                switch (*c) {
+                        case '"': os << "\\\""; break;
+                        case '\\': os << "\\\\"; break;
+                        case '\n': os << "\\n"; break;
+                        case '\t': os << "\\t"; break;
+                        default:
+                                if ((unsigned char)*c < 0x20) {
+                                        char escaped[8];
+                                        snprintf(escaped, sizeof(escaped), "\\u%04x",
+                                                 (unsigned)(unsigned char)*c);
+                                        os << escaped;
+                                } else {
+                                        os << *c;
+                                }
+                }
+        }
+        os << '"';
+}
+
 inline void write_json(std::ostream& os, KernelPerformanceInfo const& kp,
                        std::string indent = "") {
         os << indent << "{\n";
-        os << indent << "  \"kernel-name\": \"" << kp.getName() << "\",\n";
+        os << indent << "  \"kernel-name\": ";
+        write_json_string(os, kp.getName());
+        os << ",\n";
         os << indent << "  \"call-count\": " << kp.getCallCount() << ",\n";
         os << indent << "  \"total-time\": " << kp.getTime() << ",\n";
         os << indent << "  \"time-per-call\": "
            << kp.getTime() / std::max((uint64_t)1, kp.getCallCount()) << ",\n";
+        os << indent << "  \"min-time-per-call\": ";
+        write_json_number(os, kp.getMinTime());
+        os << ",\n";
+        os << indent << "  \"max-time-per-call\": ";
+        write_json_number(os, kp.getMaxTime());
+        os << ",\n";
+        os << indent << "  \"stddev-time-per-call\": " << kp.getStdDev() << ",\n";
+        if (is_region(kp)) {
+                os << indent << "  \"self-time\": ";
+                write_json_number(os, kp.getSelfTime());
+                os << ",\n";
+        }
+        if (kp.getKernelType() == DEEP_COPY) {
+                os << indent << "  \"bytes\": " << kp.getBytes() << ",\n";
+                os << indent << "  \"bandwidth-gb-per-s\": ";
+                write_json_number(os, (kp.getTime() > 0)
+                                          ? kp.getBytes() / kp.getTime() * 1.0e-9
+                                          : std::numeric_limits<double>::quiet_NaN());
+                os << ",\n";
+        }
+        os << indent << "  \"tool-overhead\": " << kp.getOverhead() << ",\n";
+        if (kp.isSampled()) {
+                os << indent << "  \"timed-calls\": " << kp.getTimedCount() << ",\n";
+                os << indent << "  \"total-time-error-95\": " << kp.getTimeError() << ",\n";
+        }
+        if (kp.getRankCount() > 1) {
+                os << indent << "  \"rank-count\": " << kp.getRankCount() << ",\n";
+                os << indent << "  \"rank-min-time\": " << kp.getRankMinTime() << ",\n";
+                os << indent << "  \"rank-max-time\": " << kp.getRankMaxTime() << ",\n";
+                os << indent << "  \"rank-imbalance\": " << kp.getRankImbalance() << ",\n";
+                os << indent << "  \"rank-mean-time\": " << kp.getRankMeanTime() << ",\n";
+                os << indent << "  \"rank-stddev-time\": " << kp.getRankStdDev() << ",\n";
+                os << indent << "  \"rank-imbalance-cost\": " << kp.getRankImbalanceCost()
+                   << ",\n";
+                if (kp.getRankMaxSource() != NULL) {
+                        os << indent << "  \"rank-max-file\": ";
+                        write_json_string(os, kp.getRankMaxSource());
+                        os << ",\n";
+                }
+                if (kp.getRankMaxRank() >= 0)
+                        os << indent << "  \"rank-max-rank\": " << kp.getRankMaxRank()
+                           << ",\n";
+        }
         os << indent << "  \"kernel-type\": " << to_string(kp.getKernelType())
            << '\n';
         os << indent << '}';
 }
+
+inline void write_json_array(std::ostream& os, const char* name,
+                             std::vector<KernelPerformanceInfo*> const& kernels,
+                             bool (*selected)(KernelPerformanceInfo const&),
+                             bool last) {
+        os << "  \"" << name << "\" : [\n";
+        bool add_comma = false;
+        for (auto const& kp : kernels) {
+                if (!selected(*kp)) continue;
+                if (add_comma) os << ",\n";
+                add_comma = true;
+                write_json(os, *kp, "    ");
+        }
+        os << '\n';
+        os << (last ? "  ]\n" : "  ],\n");
+}
 // clang-format off
 
 bool compareKernelPerformanceInfo(KernelPerformanceInfo* left, KernelPerformanceInfo* right) {
 	return left->getTime() > right->getTime();
 };
 
-int find_index(std::vector<KernelPerformanceInfo*>& kernels,
-	const char* kernelName) {
-
-	for(int i = 0; i < kernels.size(); i++) {
-		KernelPerformanceInfo* nextKernel = kernels[i];
-
-		if(strcmp(nextKernel->getName(), kernelName) == 0) {
-			return i;
-		}
-	}
-
-	return -1;
-}
-
 int main(int argc, char* argv[]) {
 
 	if(argc == 1) {
@@ -127,42 +222,55 @@ int main(int argc, char* argv[]) {
           commandline_args++;
         }
 
-	std::vector<KernelPerformanceInfo*> kernelInfo;
+	KernelMergeTable merged;
 	double totalKernelsTime = 0;
 	double totalExecuteTime = 0;
+	double totalFenceTime = 0;
+	double totalDeepCopyTime = 0;
 	uint64_t totalKernelsCalls = 0;
 
 	for(int i = commandline_args; i < argc; i++) {
-		FILE* the_file = fopen(argv[i], "rb");
-
-		double fileExecuteTime = 0;
-		fread(&fileExecuteTime, sizeof(fileExecuteTime), 1, the_file);
-
-		totalExecuteTime += fileExecuteTime;
-
-		while(! feof(the_file)) {
-			KernelPerformanceInfo* new_kernel = new KernelPerformanceInfo("", PARALLEL_FOR);
-			if(new_kernel->readFromFile(the_file)) {
-			   if(strlen(new_kernel->getName()) > 0) {
-				int kernelIndex = find_index(kernelInfo, new_kernel->getName());
-
-				if(kernelIndex > -1) {
-					kernelInfo[kernelIndex]->addTime(new_kernel->getTime());
-					kernelInfo[kernelIndex]->addCallCount(new_kernel->getCallCount());
-				} else {
-					kernelInfo.push_back(new_kernel);
-				}
-                           }
-			}
+		KernelFileReader the_file;
+
+		if(! the_file.open(argv[i])) {
+			fprintf(stderr, "Unable to read %s, skipping it\n", argv[i]);
+			continue;
 		}
 
-		fclose(the_file);
+		totalExecuteTime += the_file.getTotalExecuteTime();
+
+		KernelFileRankSamples file_ranks;
+
+		for(uint64_t r = 0; r < the_file.getRecordCount(); r++) {
+			const char* kernelName = the_file.getName(r);
+			if(strlen(kernelName) == 0) continue;
+
+			KernelPerformanceInfo* kernel = merged.get(kernelName, std::string(), the_file.getKernelType(r));
+
+			the_file.mergeInto(r, *kernel);
+			file_ranks.add(kernel, the_file.getRankSample(r));
+		}
+
+		file_ranks.mergeInto(argv[i]);
+	}
+
+	std::vector<KernelPerformanceInfo*> kernelInfo(merged.getKernels());
+
+	DemangleCache demangled;
+
+	for(int i = 0; i < kernelInfo.size(); i++) {
+		kernelInfo[i]->demangle(demangled);
 	}
 
 	std::sort(kernelInfo.begin(), kernelInfo.end(), compareKernelPerformanceInfo);
 
+	// fences and deep copies are totalled apart from kernels, as in kp_reader
 	for(int i = 0; i < kernelInfo.size(); i++) {
-    if(kernelInfo[i]->getKernelType() != REGION) {
+    if(kernelInfo[i]->getKernelType() == FENCE) {
+      totalFenceTime += kernelInfo[i]->getTime();
+    } else if(kernelInfo[i]->getKernelType() == DEEP_COPY) {
+      totalDeepCopyTime += kernelInfo[i]->getTime();
+    } else if(kernelInfo[i]->getKernelType() != REGION) {
 		  totalKernelsTime += kernelInfo[i]->getTime();
 		  totalKernelsCalls += kernelInfo[i]->getCallCount();
     }
@@ -177,37 +285,24 @@ int main(int argc, char* argv[]) {
 
         fout << "  \"total-app-time\" : " << totalExecuteTime << ",\n";
         fout << "  \"total-kernel-time\" : " << totalKernelsTime << ",\n";
+        fout << "  \"total-fence-time\" : " << totalFenceTime << ",\n";
+        fout << "  \"total-deep-copy-time\" : " << totalDeepCopyTime << ",\n";
+        // kept as total minus kernels only; fences and copies count as
+        // non-kernel time here, unlike in total-time-outside-kokkos
         fout << "  \"total-non-kernel-time\" : "
              << totalExecuteTime - totalKernelsTime << ",\n";
+        // same as kp_reader's "Time outside Kokkos kernels, fences and copies"
+        fout << "  \"total-time-outside-kokkos\" : "
+             << totalExecuteTime - totalKernelsTime - totalFenceTime - totalDeepCopyTime
+             << ",\n";
         fout << "  \"percent-in-kernels\" : "
              << 100. * totalKernelsTime / totalExecuteTime << ",\n";
         fout << "  \"unique-kernel-calls\" : " << totalKernelsCalls << ",\n";
 
-        fout << "  \"region-data\" : [\n";
-        {
-                bool add_comma = false;
-                for (auto const& kp : kernelInfo) {
-                        if (!is_region(*kp)) continue;
-                        if (add_comma) fout << ",\n";
-                        add_comma = true;
-                        write_json(fout, *kp, "    ");
-                }
-                fout << '\n';
-        }
-        fout << "  ],\n";
-
-        fout << "  \"kernel-data\" : [\n";
-        {
-                bool add_comma = false;
-                for (auto const& kp : kernelInfo) {
-                        if (is_region(*kp)) continue;
-                        if (add_comma) fout << ",\n";
-                        add_comma = true;
-                        write_json(fout, *kp, "    ");
-                }
-                fout << '\n';
-        }
-        fout << "  ]\n";
+        write_json_array(fout, "region-data", kernelInfo, is_region, false);
+        write_json_array(fout, "kernel-data", kernelInfo, is_kernel, false);
+        write_json_array(fout, "fence-data", kernelInfo, is_fence, false);
+        write_json_array(fout, "deep-copy-data", kernelInfo, is_deep_copy, true);
 
         fout << "}\n";
         // clang-format off
@@ -0,0 +1,1709 @@
+//@HEADER
+// ************************************************************************
+//
+//                        Kokkos v. 3.0
+//       Copyright (2020) National Technology & Engineering
+//               Solutions of Sandia, LLC (NTESS).
+//
+// Under the terms of Contract DE-NA0003525 with NTESS,
+// the U.S. Government retains certain rights in this software.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+// 1. Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright
+// notice, this list of conditions and the following disclaimer in the
+// documentation and/or other materials provided with the distribution.
+//
+// 3. Neither the name of the Corporation nor the names of the
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY NTESS "AS IS" AND ANY
+// EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+// PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL NTESS OR THE
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+// NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+// Questions? Contact David Poliakoff (dzpolia@sandia.gov)
+//
+// ************************************************************************
+//@HEADER
+
+#ifndef _H_KOKKOSP_KERNEL_FILE
+#define _H_KOKKOSP_KERNEL_FILE
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <mutex>
+#include <new>
+#include <unordered_map>
+
+#include "kp_kernel_info.h"
+
+// Version 2 of the kernel timing file. The file starts with a fixed header
+// followed by sections, each an array of fixed-width, 8-byte aligned
+// entries, so a reader can map the file and walk the records in place:
+//
+//   STRINGS    - NUL-terminated names and region paths, referenced by
+//                byte offset
+//   RECORDS    - one KernelFileRecord per kernel or region
+//   HISTOGRAM  - non-empty histogram buckets, referenced by the records
+//   LAUNCH_GAPS - host time between consecutive kernels, per pair of
+//                records; optional
+//   KERNEL_CHAINS - runs of 2 or 3 consecutive kernels in one region,
+//                records; optional
+//
+// All times in the file are in ticks of the recorded clock and are
+// converted with secondsPerTick from the header. Version 1 files (no magic,
+// length-prefixed records) are still read through KernelFileReader.
+#define KERNEL_FILE_MAGIC "KPKTIMER"
+#define KERNEL_FILE_VERSION 2
+#define KERNEL_FILE_ENDIAN_MARKER 0x01020304
+#define KERNEL_FILE_MAX_SECTIONS 16
+#define KERNEL_SNAPSHOT_MAGIC "KPKSNAPS"
+
+enum KernelFileSectionType {
+	KERNEL_FILE_SECTION_STRINGS = 1,
+	KERNEL_FILE_SECTION_RECORDS = 2,
+	KERNEL_FILE_SECTION_HISTOGRAM = 3,
+	KERNEL_FILE_SECTION_LAUNCH_GAPS = 4,
+	KERNEL_FILE_SECTION_KERNEL_CHAINS = 5
+};
+
+struct KernelFileSection {
+	uint32_t type;
+	uint32_t entrySize;
+	uint64_t offset;
+	uint64_t count;
+};
+
+struct KernelFileHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t endianMarker;
+	uint32_t headerSize;
+	uint32_t sectionCount;
+	int32_t rank;             // -1 when not launched under MPI
+	uint32_t clockSource;     // KernelTimerClock
+	uint64_t pid;
+	double secondsPerTick;
+	uint64_t totalTicks;      // time from tool initialization to finalization
+	char hostname[64];
+	KernelFileSection sections[KERNEL_FILE_MAX_SECTIONS];
+};
+
+// New fields are only ever appended; the entry size of the RECORDS section
+// tells a reader which of them a file has.
+struct KernelFileRecord {
+	uint64_t nameOffset;
+	uint32_t kernelType;
+	uint32_t histogramCount;
+	uint64_t histogramOffset;
+	uint64_t histogramMax;    // ns
+	uint64_t callCount;
+	double time;
+	double m2;
+	double minTime;
+	double maxTime;
+	uint64_t pathOffset;      // enclosing region path, "" when not recorded
+	double selfTime;          // regions only: time not spent in children
+	uint64_t bytes;           // deep copies only: bytes moved
+	uint64_t rankCount;       // ranks merged into the record, 0 for one process
+	double rankMinTime;       // total time on the least loaded of those ranks
+	double rankMaxTime;       // total time on the most loaded of those ranks
+	uint64_t timedCount;      // invocations timed, less than callCount when sampled
+	double timeVariance;      // variance of time when it is estimated from samples
+	double overhead;          // estimated time the tool spent in the callbacks of
+	                          // the kernel, or of those nested in the region
+	double rankM2;            // sum of squared deviations of the ranks' total times
+	uint64_t endTicks;        // arena files only: end of the last timed call, in
+	                          // ticks since tool initialization
+	int64_t rankMaxRank;      // MPI merged files only: the rank whose total time
+	                          // is rankMaxTime, -1 when unknown
+};
+
+// Size of the records written by the first version 2 writer
+#define KERNEL_FILE_RECORD_MIN_SIZE offsetof(KernelFileRecord, pathOffset)
+
+struct KernelFileBucket {
+	uint32_t bucket;
+	uint32_t reserved;
+	uint64_t count;
+};
+
+// Time from the end of one kernel to the begin of the next on the same host
+// thread, over every time nextRecord followed prevRecord
+struct KernelFileLaunchGap {
+	uint32_t prevRecord;
+	uint32_t nextRecord;
+	uint64_t count;
+	double time;
+	double maxTime;
+};
+
+// Longest run of consecutive kernels kept as a fusion candidate
+#define KERNEL_CHAIN_MAX 3
+
+// A run of length consecutive kernels launched by one host thread inside
+// the same region, over every time it was seen; time is the sum of the
+// kernels' own times
+struct KernelFileKernelChain {
+	uint32_t length;
+	uint32_t records[KERNEL_CHAIN_MAX];
+	uint64_t count;
+	double time;
+};
+
+// Adds the statistics of a record to info, scaling its times by scale.
+// recordSize is the entry size of the file's records, so fields appended
+// after it was written are skipped. The rank statistics are left to
+// KernelFileRankSamples, which adds them once per file.
+void mergeKernelFileRecord(const KernelFileRecord& record, const KernelFileBucket* buckets,
+	const double scale, const size_t recordSize, KernelPerformanceInfo& info) {
+
+	info.mergeStats(record.callCount, record.time * scale,
+		record.m2 * scale * scale, record.minTime * scale,
+		record.maxTime * scale);
+
+	if(recordSize >= offsetof(KernelFileRecord, selfTime) + sizeof(double)) {
+		info.addSelfTime(record.selfTime * scale);
+	}
+
+	if(recordSize >= offsetof(KernelFileRecord, bytes) + sizeof(uint64_t)) {
+		info.addBytes(record.bytes);
+	}
+
+	if(recordSize >= offsetof(KernelFileRecord, overhead) + sizeof(double)) {
+		info.addOverhead(record.overhead * scale);
+	}
+
+	if(recordSize >= offsetof(KernelFileRecord, timeVariance) + sizeof(double)) {
+		info.addSampling(record.timedCount, record.timeVariance * scale * scale);
+	} else {
+		info.addSampling(record.callCount, 0);
+	}
+
+	KernelTimeHistogram& histogram = info.getHistogram();
+
+	if(NULL != buckets) {
+		for(uint32_t i = 0; i < record.histogramCount; i++) {
+			if(buckets[i].bucket < HISTOGRAM_BUCKETS) {
+				histogram.counts[buckets[i].bucket] += buckets[i].count;
+			}
+		}
+	}
+
+	if(record.histogramMax > histogram.maxValue) {
+		histogram.maxValue = record.histogramMax;
+	}
+}
+
+// Rank of this process as exported by the common MPI launchers
+int32_t getLaunchRank() {
+	const char* rankVars[] = { "OMPI_COMM_WORLD_RANK", "PMI_RANK", "PMIX_RANK",
+		"MV2_COMM_WORLD_RANK", "SLURM_PROCID" };
+
+	for(size_t i = 0; i < sizeof(rankVars) / sizeof(rankVars[0]); i++) {
+		const char* rank = getenv(rankVars[i]);
+
+		if(NULL != rank) {
+			return (int32_t) atoi(rank);
+		}
+	}
+
+	return -1;
+}
+
+class KernelFileWriter {
+	public:
+		// Returns the index of the record
+		uint32_t addKernel(const KernelPerformanceInfo& info) {
+			KernelFileRecord record;
+			memset(&record, 0, sizeof(record));
+
+			const KernelTimeHistogram& histogram = info.getHistogram();
+
+			record.nameOffset = internString(info.getName());
+			record.kernelType = (uint32_t) info.getKernelType();
+			record.histogramOffset = buckets.size();
+			record.histogramMax = histogram.maxValue;
+			record.callCount = info.getCallCount();
+			record.time = info.getTime();
+			record.m2 = info.getM2();
+			record.minTime = info.getMinTime();
+			record.maxTime = info.getMaxTime();
+			record.pathOffset = internString(info.getRegionPath().c_str());
+			record.selfTime = info.getSelfTime();
+			record.bytes = info.getBytes();
+			record.rankCount = info.getRankCount();
+			record.rankMinTime = info.getRankMinTime();
+			record.rankMaxTime = info.getRankMaxTime();
+			record.rankMaxRank = info.getRankMaxRank();
+			record.timedCount = info.getTimedCount();
+			record.timeVariance = info.getTimeVariance();
+			record.overhead = info.getOverhead();
+			record.rankM2 = info.getRankM2();
+
+			for(uint32_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+				if(0 == histogram.counts[i]) continue;
+
+				KernelFileBucket bucket;
+				bucket.bucket = i;
+				bucket.reserved = 0;
+				bucket.count = histogram.counts[i];
+				buckets.push_back(bucket);
+			}
+
+			record.histogramCount = (uint32_t) (buckets.size() - record.histogramOffset);
+			records.push_back(record);
+
+			return (uint32_t) (records.size() - 1);
+		}
+
+		void addLaunchGap(const uint32_t prevRecord, const uint32_t nextRecord,
+			const uint64_t count, const double time, const double maxTime) {
+
+			KernelFileLaunchGap gap;
+			gap.prevRecord = prevRecord;
+			gap.nextRecord = nextRecord;
+			gap.count = count;
+			gap.time = time;
+			gap.maxTime = maxTime;
+			launchGaps.push_back(gap);
+		}
+
+		void addKernelChain(const uint32_t length, const uint32_t* chainRecords,
+			const uint64_t count, const double time) {
+
+			KernelFileKernelChain chain;
+			memset(&chain, 0, sizeof(chain));
+			chain.length = length;
+			memcpy(chain.records, chainRecords, length * sizeof(uint32_t));
+			chain.count = count;
+			chain.time = time;
+			kernelChains.push_back(chain);
+		}
+
+		// tickSeconds is the length of the ticks the kernels were recorded in
+		bool write(const char* path, const uint64_t totalTicks,
+			const double tickSeconds = secondsPerTick) {
+			FILE* output = fopen(path, "wb");
+			if(NULL == output) {
+				return false;
+			}
+
+			// keep every section 8-byte aligned
+			while(strings.size() % 8 != 0) {
+				strings.push_back('\0');
+			}
+
+			KernelFileHeader header;
+			memset(&header, 0, sizeof(header));
+
+			memcpy(header.magic, KERNEL_FILE_MAGIC, sizeof(header.magic));
+			header.version = KERNEL_FILE_VERSION;
+			header.endianMarker = KERNEL_FILE_ENDIAN_MARKER;
+			header.headerSize = sizeof(KernelFileHeader);
+			header.rank = getLaunchRank();
+			header.clockSource = (uint32_t) clockSource;
+			header.pid = (uint64_t) getpid();
+			header.secondsPerTick = tickSeconds;
+			header.totalTicks = totalTicks;
+			gethostname(header.hostname, sizeof(header.hostname) - 1);
+
+			uint64_t offset = sizeof(KernelFileHeader);
+			addSection(header, KERNEL_FILE_SECTION_STRINGS, 1, strings.size(), offset);
+			addSection(header, KERNEL_FILE_SECTION_RECORDS, sizeof(KernelFileRecord), records.size(), offset);
+			addSection(header, KERNEL_FILE_SECTION_HISTOGRAM, sizeof(KernelFileBucket), buckets.size(), offset);
+			addSection(header, KERNEL_FILE_SECTION_LAUNCH_GAPS, sizeof(KernelFileLaunchGap),
+				launchGaps.size(), offset);
+			addSection(header, KERNEL_FILE_SECTION_KERNEL_CHAINS, sizeof(KernelFileKernelChain),
+				kernelChains.size(), offset);
+
+			bool success = (1 == fwrite(&header, sizeof(header), 1, output));
+			success = success && writeArray(output, strings);
+			success = success && writeArray(output, records);
+			success = success && writeArray(output, buckets);
+			success = success && writeArray(output, launchGaps);
+			success = success && writeArray(output, kernelChains);
+
+			return (0 == fclose(output)) && success;
+		}
+
+	private:
+		uint64_t internString(const char* str) {
+			const std::string key(str);
+			auto string_itr = stringOffsets.find(key);
+
+			if(string_itr != stringOffsets.end()) {
+				return string_itr->second;
+			}
+
+			const uint64_t offset = strings.size();
+			strings.insert(strings.end(), str, str + key.size() + 1);
+			stringOffsets.insert(std::make_pair(key, offset));
+
+			return offset;
+		}
+
+		void addSection(KernelFileHeader& header, const uint32_t type,
+			const uint32_t entrySize, const uint64_t count, uint64_t& offset) {
+
+			KernelFileSection& section = header.sections[header.sectionCount++];
+			section.type = type;
+			section.entrySize = entrySize;
+			section.offset = offset;
+			section.count = count;
+
+			offset += entrySize * count;
+		}
+
+		template<typename T>
+		bool writeArray(FILE* output, const std::vector<T>& data) {
+			return data.empty() || (data.size() == fwrite(&data[0], sizeof(T), data.size(), output));
+		}
+
+		std::vector<char> strings;
+		std::unordered_map<std::string, uint64_t> stringOffsets;
+		std::vector<KernelFileRecord> records;
+		std::vector<KernelFileBucket> buckets;
+		std::vector<KernelFileLaunchGap> launchGaps;
+		std::vector<KernelFileKernelChain> kernelChains;
+};
+
+// A record of the running tool. Its statistics are updated in place, by
+// the one thread that owns it.
+//
+// A sampled kernel times each invocation with probability 1/samplePeriod,
+// drawing geometric gaps between timed invocations so that sampling cannot
+// lock onto a periodic pattern of calls. A timed invocation stands for the
+// samplePeriod invocations it was drawn from. callCount counts every
+// invocation; time and m2 are the weighted sample mean and variance scaled
+// up to callCount, and the histogram is weighted. timeVariance is the
+// variance of that estimate of the total time, from the effective sample
+// size of the weights.
+#define KERNEL_SAMPLE_PERIOD_MAX 65536
+
+class KernelArenaRecord {
+	public:
+		KernelArenaRecord(KernelFileRecord* newRecord, KernelFileBucket* newBuckets,
+			const char* newName, const char* newRegionPath, const uint64_t newRegionPathHash) :
+			record(newRecord), buckets(newBuckets), name(newName),
+			regionPath(newRegionPath), regionPathHash(newRegionPathHash),
+			samplePeriod(1), countdown(1), random((uint64_t) (uintptr_t) newRecord | 1),
+			totalWeight(0), weightSqSum(0), weightedTime(0), weightedM2(0) {}
+
+		// Counts an invocation that is not timed and returns 0, or returns
+		// the weight to time it with
+		uint32_t sampleInvocation() {
+			if(--countdown > 0) {
+				record->callCount++;
+				return 0;
+			}
+
+			countdown = (1 == samplePeriod) ? 1 : nextGap();
+			return samplePeriod;
+		}
+
+		void setSamplePeriod(const uint32_t period) {
+			samplePeriod = period;
+		}
+
+		uint64_t getTimedCount() const {
+			return record->timedCount;
+		}
+
+		// t is in ticks, weighted as in West's incremental algorithm
+		void addTime(const double t, const uint32_t weight = 1) {
+			const double w = (double) weight;
+			const double previousMean = (totalWeight > 0) ? weightedTime / totalWeight : 0.0;
+
+			totalWeight += w;
+			weightSqSum += w * w;
+			weightedTime += w * t;
+			weightedM2 += w * (t - previousMean) * (t - weightedTime / totalWeight);
+
+			record->callCount++;
+			record->timedCount++;
+
+			record->minTime = fmin(record->minTime, t);
+			record->maxTime = fmax(record->maxTime, t);
+
+			const uint64_t ns = (uint64_t) (ticksToSeconds(t) * 1.0e9);
+			buckets[KernelTimeHistogram::bucketIndex(ns)].count += weight;
+
+			if(ns > record->histogramMax) {
+				record->histogramMax = ns;
+			}
+
+			updateEstimate();
+		}
+
+		// Scales the sample up to the invocations counted so far. Untimed
+		// invocations after the last timed one are only accounted for once
+		// this is called again.
+		void updateEstimate() {
+			if(0 == totalWeight) return;
+
+			const double calls = (double) record->callCount;
+			const double scale = calls / totalWeight;
+
+			record->time = weightedTime * scale;
+			record->m2 = weightedM2 * scale;
+
+			if(record->timedCount < record->callCount && totalWeight > 1) {
+				const double variance = weightedM2 / (totalWeight - 1.0);
+				const double effectiveSamples = totalWeight * totalWeight / weightSqSum;
+
+				record->timeVariance = calls * calls * variance / effectiveSamples *
+					(1.0 - (double) record->timedCount / calls);
+			}
+		}
+
+		void addSelfTime(const double t) {
+			record->selfTime += t;
+		}
+
+		void addOverhead(const double t) {
+			record->overhead += t;
+		}
+
+		void addBytes(const uint64_t bytes) {
+			record->bytes += bytes;
+		}
+
+		void setEndTicks(const uint64_t ticks) {
+			record->endTicks = ticks;
+		}
+
+		const char* getName() const {
+			return name;
+		}
+
+		const char* getRegionPath() const {
+			return regionPath;
+		}
+
+		uint64_t getRegionPathHash() const {
+			return regionPathHash;
+		}
+
+		KernelExecutionType getKernelType() const {
+			return (KernelExecutionType) record->kernelType;
+		}
+
+		uint64_t getCallCount() const {
+			return record->callCount;
+		}
+
+		double getTime() const {
+			return record->time;
+		}
+
+		const KernelFileRecord& getRecord() const {
+			return *record;
+		}
+
+		const KernelFileBucket* getBuckets() const {
+			return buckets;
+		}
+
+	private:
+		KernelFileRecord* record;
+		KernelFileBucket* buckets;
+		const char* name;
+		const char* regionPath;
+		uint64_t regionPathHash;
+
+		// Geometrically distributed number of invocations up to the next
+		// timed one, with mean samplePeriod
+		uint32_t nextGap() {
+			random ^= random >> 12;
+			random ^= random << 25;
+			random ^= random >> 27;
+
+			const double u = ((random * 2685821657736338717ULL) >> 11) * (1.0 / 9007199254740992.0);
+			const double gap = 1.0 + floor(log1p(-u) / log1p(-1.0 / (double) samplePeriod));
+
+			return (gap > 4.0 * KERNEL_SAMPLE_PERIOD_MAX) ? 4 * KERNEL_SAMPLE_PERIOD_MAX : (uint32_t) gap;
+		}
+
+		uint32_t samplePeriod;
+		uint32_t countdown;
+		uint64_t random;          // xorshift64* state
+		double totalWeight;
+		double weightSqSum;
+		double weightedTime;
+		double weightedM2;
+};
+
+// The records of the running tool, kept in a shared mapping of the output
+// file laid out as a version 2 file, so that the statistics of a job that
+// is killed are already on disk. Sections are preallocated for a fixed
+// number of records (the file is sparse until they are used), histograms
+// are stored dense, and the section counts are only advanced once a
+// record is complete, so the file is readable at any point. totalTicks is
+// only stored at finalize; until then the endTicks of the records tell how
+// far the run got.
+//
+// Records past the capacity, or all records when the file cannot be
+// mapped, are kept on the heap and only reach the file at finalize.
+#define KERNEL_ARENA_STRING_BYTES 256
+
+class KernelFileArena {
+	public:
+		KernelFileArena() :
+			base(NULL), mappedSize(0), fd(-1), header(NULL), strings(NULL),
+			records(NULL), buckets(NULL), recordCapacity(0), stringCapacity(0),
+			recordCount(0), stringsUsed(0), warnedFull(false) {}
+
+		// Returns false when the records are kept on the heap only
+		bool open(const char* path, const uint64_t capacity) {
+			recordCapacity = capacity;
+			stringCapacity = capacity * KERNEL_ARENA_STRING_BYTES;
+
+			const uint64_t stringsOffset = sizeof(KernelFileHeader);
+			const uint64_t recordsOffset = stringsOffset + stringCapacity;
+			const uint64_t bucketsOffset = recordsOffset + recordCapacity * sizeof(KernelFileRecord);
+			mappedSize = bucketsOffset + recordCapacity * HISTOGRAM_BUCKETS * sizeof(KernelFileBucket);
+
+			fd = ::open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+
+			if(fd >= 0 && 0 == ftruncate(fd, (off_t) mappedSize)) {
+				base = mmap(NULL, mappedSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+			}
+
+			if(NULL == base || MAP_FAILED == base) {
+				base = NULL;
+
+				if(fd >= 0) {
+					::close(fd);
+					unlink(path);
+					fd = -1;
+				}
+
+				recordCapacity = 0;
+				stringCapacity = 0;
+				return false;
+			}
+
+			header = (KernelFileHeader*) base;
+			strings = (char*) base + stringsOffset;
+			records = (KernelFileRecord*) ((char*) base + recordsOffset);
+			buckets = (KernelFileBucket*) ((char*) base + bucketsOffset);
+
+			// offset 0 is the empty string, so a zeroed record has no name
+			stringsUsed = 1;
+
+			uint64_t offset = stringsOffset;
+			addSection(KERNEL_FILE_SECTION_STRINGS, 1, stringCapacity, offset);
+			addSection(KERNEL_FILE_SECTION_RECORDS, sizeof(KernelFileRecord), recordCapacity, offset);
+			addSection(KERNEL_FILE_SECTION_HISTOGRAM, sizeof(KernelFileBucket),
+				recordCapacity * HISTOGRAM_BUCKETS, offset);
+
+			header->sections[0].count = stringsUsed;
+
+			memcpy(header->magic, KERNEL_FILE_MAGIC, sizeof(header->magic));
+			header->version = KERNEL_FILE_VERSION;
+			header->endianMarker = KERNEL_FILE_ENDIAN_MARKER;
+			header->headerSize = sizeof(KernelFileHeader);
+			header->rank = getLaunchRank();
+			header->clockSource = (uint32_t) clockSource;
+			header->pid = (uint64_t) getpid();
+			header->secondsPerTick = secondsPerTick;
+			gethostname(header->hostname, sizeof(header->hostname) - 1);
+
+			return true;
+		}
+
+		KernelArenaRecord* addRecord(const char* name, const char* regionPath,
+			const uint64_t regionPathHash, const KernelExecutionType kType) {
+
+			std::lock_guard<std::mutex> lock(arena_lock);
+
+			const size_t nameLen = strlen(name) + 1;
+			const size_t pathLen = (0 == regionPath[0]) ? 0 : strlen(regionPath) + 1;
+
+			KernelFileRecord* record = NULL;
+			KernelFileBucket* recordBuckets = NULL;
+			char* recordName = NULL;
+			char* recordPath = NULL;
+
+			const bool inArena = recordCount < recordCapacity &&
+				stringsUsed + nameLen + pathLen <= stringCapacity;
+
+			if(inArena) {
+				record = &records[recordCount];
+				recordBuckets = &buckets[recordCount * HISTOGRAM_BUCKETS];
+
+				recordName = strings + stringsUsed;
+				memcpy(recordName, name, nameLen);
+				record->nameOffset = stringsUsed;
+
+				recordPath = strings + stringsUsed + nameLen;
+				memcpy(recordPath, regionPath, pathLen);
+				record->pathOffset = (0 == pathLen) ? 0 : stringsUsed + nameLen;
+
+				record->histogramOffset = recordCount * HISTOGRAM_BUCKETS;
+				stringsUsed += nameLen + pathLen;
+			} else {
+				if(! warnedFull && recordCapacity > 0) {
+					fprintf(stderr, "KokkosP: Warning: more than %llu kernel records, the rest "
+						"are only written at finalize (see KOKKOSP_KERNEL_TIMER_ARENA_RECORDS)\n",
+						(unsigned long long) recordCapacity);
+					warnedFull = true;
+				}
+
+				record = (KernelFileRecord*) calloc(1, sizeof(KernelFileRecord));
+				recordBuckets = (KernelFileBucket*) calloc(HISTOGRAM_BUCKETS, sizeof(KernelFileBucket));
+				recordName = strdup(name);
+				recordPath = strdup(regionPath);
+			}
+
+			initRecord(record, recordBuckets, kType);
+
+			if(inArena) {
+				recordCount++;
+
+				__atomic_store_n(&header->sections[0].count, stringsUsed, __ATOMIC_RELEASE);
+				__atomic_store_n(&header->sections[2].count, recordCount * HISTOGRAM_BUCKETS, __ATOMIC_RELEASE);
+				__atomic_store_n(&header->sections[1].count, recordCount, __ATOMIC_RELEASE);
+			}
+
+			KernelArenaRecord* arenaRecord = new KernelArenaRecord(record, recordBuckets,
+				recordName, (0 == pathLen) ? "" : recordPath, regionPathHash);
+			allRecords.push_back(arenaRecord);
+
+			return arenaRecord;
+		}
+
+		// Sets up a zeroed record and its HISTOGRAM_BUCKETS dense buckets
+		static void initRecord(KernelFileRecord* record, KernelFileBucket* recordBuckets,
+			const KernelExecutionType kType) {
+
+			record->kernelType = (uint32_t) kType;
+			record->histogramCount = HISTOGRAM_BUCKETS;
+			record->minTime = std::numeric_limits<double>::quiet_NaN();
+			record->maxTime = std::numeric_limits<double>::quiet_NaN();
+			record->rankMaxRank = -1;
+
+			for(uint32_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+				recordBuckets[i].bucket = i;
+			}
+		}
+
+		// Called from any thread; the stored value only grows
+		void setTotalTicks(const uint64_t totalTicks) {
+			if(NULL == header) return;
+
+			uint64_t stored = __atomic_load_n(&header->totalTicks, __ATOMIC_RELAXED);
+
+			while(stored < totalTicks && ! __atomic_compare_exchange_n(&header->totalTicks,
+				&stored, totalTicks, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {}
+		}
+
+		// Every record, in allocation order; only valid once no thread adds
+		// records any more
+		const std::vector<KernelArenaRecord*>& getRecords() const {
+			return allRecords;
+		}
+
+		// Drops the mapping. The file stays as it is, so finalize replaces it
+		// with the compact file first.
+		void close() {
+			if(NULL != base) {
+				munmap(base, mappedSize);
+				::close(fd);
+
+				base = NULL;
+				header = NULL;
+				fd = -1;
+			}
+		}
+
+	private:
+		void addSection(const uint32_t type, const uint32_t entrySize,
+			const uint64_t capacity, uint64_t& offset) {
+
+			KernelFileSection& section = header->sections[header->sectionCount++];
+			section.type = type;
+			section.entrySize = entrySize;
+			section.offset = offset;
+			section.count = 0;
+
+			offset += entrySize * capacity;
+		}
+
+		void* base;
+		size_t mappedSize;
+		int fd;
+
+		KernelFileHeader* header;
+		char* strings;
+		KernelFileRecord* records;
+		KernelFileBucket* buckets;
+
+		uint64_t recordCapacity;
+		uint64_t stringCapacity;
+		uint64_t recordCount;
+		uint64_t stringsUsed;
+		bool warnedFull;
+
+		std::mutex arena_lock;
+		std::vector<KernelArenaRecord*> allRecords;
+};
+
+// The share of one file in a kernel's rank statistics: the ranks it holds
+// and the sum, sum of squared deviations, least and most of their total
+// times, and the rank with the most (-1 when unknown). A file of one
+// process holds one rank.
+struct KernelRankSample {
+	uint64_t ranks;
+	double total;
+	double m2;
+	double minTotal;
+	double maxTotal;
+	int64_t maxRank;
+};
+
+// Sums the records of one file per merged kernel, so that the file adds
+// one rank sample to each kernel however many of its records merge into it
+// (region paths rolled up, or the per-thread records of an arena file).
+// Records merged over the same ranks are summed rank by rank as if the
+// ranks were ordered alike in each, which is exact for one rank and bounds
+// the spread otherwise.
+class KernelFileRankSamples {
+	public:
+		void add(KernelPerformanceInfo* kernel, const KernelRankSample& sample) {
+			auto inserted = samples.insert(std::make_pair(kernel, sample));
+			if(inserted.second) return;
+
+			KernelRankSample& sum = inserted.first->second;
+			const double stdDevs = sqrt(sum.m2) + sqrt(sample.m2);
+
+			sum.ranks = std::max(sum.ranks, sample.ranks);
+			sum.total += sample.total;
+			sum.m2 = stdDevs * stdDevs;
+			sum.minTotal += sample.minTotal;
+			sum.maxTotal += sample.maxTotal;
+			if(sum.maxRank != sample.maxRank) sum.maxRank = -1;
+		}
+
+		// Adds each kernel's sample to it; source names the file, recorded on
+		// the kernels whose most loaded rank it holds
+		void mergeInto(const char* source) {
+			for(auto sample_itr = samples.begin(); sample_itr != samples.end(); sample_itr++) {
+				KernelPerformanceInfo& info = *sample_itr->first;
+				const KernelRankSample& sample = sample_itr->second;
+				const double previousMax = info.getRankMaxTime();
+
+				info.addRankStats(sample.ranks, sample.total, sample.m2, sample.minTotal,
+					sample.maxTotal);
+
+				if(NULL != source && ! (info.getRankMaxTime() <= previousMax)) {
+					info.setRankMaxSource(source);
+					info.setRankMaxRank(sample.maxRank);
+				}
+			}
+
+			samples.clear();
+		}
+
+	private:
+		std::unordered_map<KernelPerformanceInfo*, KernelRankSample> samples;
+};
+
+// Reads a version 1 or version 2 kernel timing file. The file is mapped
+// read-only (or read in one go where it cannot be mapped), and the records
+// of version 2 files are used in place; version 1 files are decoded from
+// the mapping into KernelPerformanceInfo objects.
+class KernelFileReader {
+	public:
+		KernelFileReader() :
+			buffer(NULL), size(0), mapped(false), header(NULL), records(NULL), recordSize(0),
+			recordCount(0), strings(NULL), stringsSize(0), buckets(NULL),
+			bucketCount(0), launchGaps(NULL), launchGapSize(0), launchGapCount(0),
+			kernelChains(NULL), kernelChainSize(0), kernelChainCount(0), totalExecuteTime(0) {}
+
+		~KernelFileReader() {
+			close();
+		}
+
+		bool open(const char* path) {
+			close();
+
+			const int fd = ::open(path, O_RDONLY);
+			if(fd < 0) {
+				return false;
+			}
+
+			const off_t fileSize = lseek(fd, 0, SEEK_END);
+
+			if(fileSize < (off_t) sizeof(double)) {
+				::close(fd);
+				return false;
+			}
+
+			size = (size_t) fileSize;
+			void* mapping = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+			if(MAP_FAILED != mapping) {
+				buffer = (char*) mapping;
+				mapped = true;
+				madvise(mapping, size, MADV_SEQUENTIAL);
+			} else {
+				buffer = (char*) malloc(size);
+
+				if(size != (size_t) pread(fd, buffer, size, 0)) {
+					::close(fd);
+					close();
+					return false;
+				}
+			}
+
+			::close(fd);
+
+			if(size >= 8 && 0 == memcmp(buffer, KERNEL_SNAPSHOT_MAGIC, 8)) {
+				fprintf(stderr, "%s: snapshot stream, read it with --timeseries\n", path);
+				close();
+				return false;
+			}
+
+			const bool success = (0 == memcmp(buffer, KERNEL_FILE_MAGIC, 8)) ?
+				openVersion2(path) : openVersion1();
+
+			if(! success) {
+				close();
+			}
+
+			return success;
+		}
+
+		void close() {
+			for(auto kernel_itr = legacyKernels.begin(); kernel_itr != legacyKernels.end(); kernel_itr++) {
+				delete *kernel_itr;
+			}
+			legacyKernels.clear();
+
+			if(mapped) {
+				munmap(buffer, size);
+			} else {
+				free(buffer);
+			}
+
+			buffer = NULL;
+			size = 0;
+			mapped = false;
+			header = NULL;
+			records = NULL;
+			recordCount = 0;
+			strings = NULL;
+			buckets = NULL;
+			bucketCount = 0;
+			launchGaps = NULL;
+			launchGapCount = 0;
+			kernelChains = NULL;
+			kernelChainCount = 0;
+			totalExecuteTime = 0;
+		}
+
+		// NULL for version 1 files
+		const KernelFileHeader* getHeader() const {
+			return header;
+		}
+
+		uint32_t getVersion() const {
+			return (NULL == header) ? 1 : header->version;
+		}
+
+		double getTotalExecuteTime() const {
+			return totalExecuteTime;
+		}
+
+		uint64_t getRecordCount() const {
+			return (NULL == header) ? legacyKernels.size() : recordCount;
+		}
+
+		// The name as recorded by the tool, i.e. not demangled
+		const char* getName(const uint64_t index) const {
+			if(NULL == header) {
+				return legacyKernels[index]->getName();
+			}
+
+			return &strings[getRecord(index)->nameOffset];
+		}
+
+		const char* getRegionPath(const uint64_t index) const {
+			if(NULL == header || ! hasRecordField(offsetof(KernelFileRecord, pathOffset),
+				sizeof(uint64_t))) {
+				return "";
+			}
+
+			return &strings[getRecord(index)->pathOffset];
+		}
+
+		KernelExecutionType getKernelType(const uint64_t index) const {
+			if(NULL == header) {
+				return legacyKernels[index]->getKernelType();
+			}
+
+			return (KernelExecutionType) getRecord(index)->kernelType;
+		}
+
+		// Statistics of a record other than its ranks; see getRankSample
+		void mergeInto(const uint64_t index, KernelPerformanceInfo& info) const {
+			if(NULL == header) {
+				info.merge(*legacyKernels[index]);
+				return;
+			}
+
+			const KernelFileRecord* record = getRecord(index);
+
+			mergeKernelFileRecord(*record,
+				(record->histogramOffset + record->histogramCount <= bucketCount) ?
+					buckets + record->histogramOffset : NULL,
+				header->secondsPerTick, recordSize, info);
+		}
+
+		// A record not merged over ranks counts as the one rank that wrote
+		// it. Ranks merged before their deviations were recorded count as
+		// uniform.
+		KernelRankSample getRankSample(const uint64_t index) const {
+			if(NULL == header) {
+				const double time = legacyKernels[index]->getTime();
+				const KernelRankSample sample = { 1, time, 0, time, time, -1 };
+				return sample;
+			}
+
+			const KernelFileRecord* record = getRecord(index);
+			const double scale = header->secondsPerTick;
+			const double time = record->time * scale;
+
+			if(! hasRecordField(offsetof(KernelFileRecord, rankMaxTime), sizeof(double)) ||
+				0 == record->rankCount) {
+
+				const KernelRankSample sample = { 1, time, 0, time, time, -1 };
+				return sample;
+			}
+
+			const double rankM2 = hasRecordField(offsetof(KernelFileRecord, rankM2), sizeof(double)) ?
+				record->rankM2 * scale * scale : 0;
+			const int64_t maxRank = hasRecordField(offsetof(KernelFileRecord, rankMaxRank), sizeof(int64_t)) ?
+				record->rankMaxRank : -1;
+			const KernelRankSample sample = { record->rankCount, time, rankM2,
+				record->rankMinTime * scale, record->rankMaxTime * scale, maxRank };
+			return sample;
+		}
+
+		// Files written while the job ran (or before launch gaps were
+		// recorded) have none
+		uint64_t getLaunchGapCount() const {
+			return launchGapCount;
+		}
+
+		// Times in seconds
+		KernelFileLaunchGap getLaunchGap(const uint64_t index) const {
+			KernelFileLaunchGap gap = *getLaunchGapEntry(index);
+			gap.time *= header->secondsPerTick;
+			gap.maxTime *= header->secondsPerTick;
+
+			return gap;
+		}
+
+		// Like launch gaps, only in files written at the end of the job
+		uint64_t getKernelChainCount() const {
+			return kernelChainCount;
+		}
+
+		// Time in seconds
+		KernelFileKernelChain getKernelChain(const uint64_t index) const {
+			KernelFileKernelChain chain = *getKernelChainEntry(index);
+			chain.time *= header->secondsPerTick;
+
+			return chain;
+		}
+
+	private:
+		const KernelFileRecord* getRecord(const uint64_t index) const {
+			return (const KernelFileRecord*) (records + index * recordSize);
+		}
+
+		const KernelFileLaunchGap* getLaunchGapEntry(const uint64_t index) const {
+			return (const KernelFileLaunchGap*) (launchGaps + index * launchGapSize);
+		}
+
+		const KernelFileKernelChain* getKernelChainEntry(const uint64_t index) const {
+			return (const KernelFileKernelChain*) (kernelChains + index * kernelChainSize);
+		}
+
+		// Fields appended to KernelFileRecord after version 2 was introduced
+		// are absent from the shorter records of older files
+		bool hasRecordField(const size_t offset, const size_t fieldSize) const {
+			return recordSize >= offset + fieldSize;
+		}
+
+		const KernelFileSection* findSection(const uint32_t type,
+			const uint32_t minEntrySize) const {
+
+			for(uint32_t i = 0; i < header->sectionCount; i++) {
+				const KernelFileSection* section = &header->sections[i];
+
+				if(section->type != type) continue;
+				if(section->entrySize < minEntrySize) return NULL;
+				if(section->offset % 8 != 0 || section->offset > size ||
+					section->count > (size - section->offset) / section->entrySize) {
+					return NULL;
+				}
+
+				return section;
+			}
+
+			return NULL;
+		}
+
+		bool openVersion2(const char* path) {
+			if(size < sizeof(KernelFileHeader)) {
+				return false;
+			}
+
+			header = (const KernelFileHeader*) buffer;
+
+			if(header->endianMarker != KERNEL_FILE_ENDIAN_MARKER) {
+				fprintf(stderr, "%s: written on a machine of different byte order\n", path);
+				return false;
+			}
+
+			if(header->version != KERNEL_FILE_VERSION) {
+				fprintf(stderr, "%s: unsupported file version %u\n", path, header->version);
+				return false;
+			}
+
+			if(header->headerSize < sizeof(KernelFileHeader) ||
+				header->sectionCount > KERNEL_FILE_MAX_SECTIONS) {
+				return false;
+			}
+
+			const KernelFileSection* stringSection = findSection(KERNEL_FILE_SECTION_STRINGS, 1);
+			const KernelFileSection* recordSection = findSection(KERNEL_FILE_SECTION_RECORDS,
+				KERNEL_FILE_RECORD_MIN_SIZE);
+			const KernelFileSection* bucketSection = findSection(KERNEL_FILE_SECTION_HISTOGRAM,
+				sizeof(KernelFileBucket));
+
+			if(NULL == stringSection || NULL == recordSection || NULL == bucketSection) {
+				return false;
+			}
+
+			strings = buffer + stringSection->offset;
+			stringsSize = stringSection->count;
+			records = buffer + recordSection->offset;
+			recordSize = recordSection->entrySize;
+			recordCount = recordSection->count;
+			buckets = (const KernelFileBucket*) (buffer + bucketSection->offset);
+			bucketCount = bucketSection->count;
+
+			if(stringsSize > 0 && strings[stringsSize - 1] != '\0') {
+				return false;
+			}
+
+			const KernelFileSection* gapSection = findSection(KERNEL_FILE_SECTION_LAUNCH_GAPS,
+				sizeof(KernelFileLaunchGap));
+
+			if(NULL != gapSection) {
+				launchGaps = buffer + gapSection->offset;
+				launchGapSize = gapSection->entrySize;
+				launchGapCount = gapSection->count;
+
+				for(uint64_t i = 0; i < launchGapCount; i++) {
+					if(getLaunchGapEntry(i)->prevRecord >= recordCount ||
+						getLaunchGapEntry(i)->nextRecord >= recordCount) {
+						return false;
+					}
+				}
+			}
+
+			const KernelFileSection* chainSection = findSection(KERNEL_FILE_SECTION_KERNEL_CHAINS,
+				sizeof(KernelFileKernelChain));
+
+			if(NULL != chainSection) {
+				kernelChains = buffer + chainSection->offset;
+				kernelChainSize = chainSection->entrySize;
+				kernelChainCount = chainSection->count;
+
+				for(uint64_t i = 0; i < kernelChainCount; i++) {
+					const KernelFileKernelChain* chain = getKernelChainEntry(i);
+					if(chain->length < 2 || chain->length > KERNEL_CHAIN_MAX) return false;
+
+					for(uint32_t k = 0; k < chain->length; k++) {
+						if(chain->records[k] >= recordCount) return false;
+					}
+				}
+			}
+
+			const bool hasPaths = hasRecordField(offsetof(KernelFileRecord, pathOffset), sizeof(uint64_t));
+			const bool hasEnds = hasRecordField(offsetof(KernelFileRecord, endTicks), sizeof(uint64_t));
+
+			// the arena of a killed run has no total, but ran at least until
+			// its last call ended
+			uint64_t totalTicks = header->totalTicks;
+
+			for(uint64_t i = 0; i < recordCount; i++) {
+				if(getRecord(i)->nameOffset >= stringsSize) {
+					return false;
+				}
+
+				if(hasPaths && getRecord(i)->pathOffset >= stringsSize) {
+					return false;
+				}
+
+				if(hasEnds && getRecord(i)->endTicks > totalTicks) {
+					totalTicks = getRecord(i)->endTicks;
+				}
+			}
+
+			totalExecuteTime = totalTicks * header->secondsPerTick;
+			return true;
+		}
+
+		// Length-prefixed records after the total time; a truncated last
+		// record ends the file
+		bool openVersion1() {
+			memcpy(&totalExecuteTime, buffer, sizeof(totalExecuteTime));
+			size_t offset = sizeof(totalExecuteTime);
+
+			while(offset + sizeof(uint32_t) <= size) {
+				uint32_t recordLen = 0;
+				memcpy(&recordLen, buffer + offset, sizeof(recordLen));
+				offset += sizeof(recordLen);
+
+				if(recordLen > size - offset) break;
+
+				KernelPerformanceInfo* kernel = new KernelPerformanceInfo("", PARALLEL_FOR);
+
+				if(kernel->readFromBuffer(buffer + offset, recordLen) && strlen(kernel->getName()) > 0) {
+					legacyKernels.push_back(kernel);
+				} else {
+					delete kernel;
+				}
+
+				offset += recordLen;
+			}
+
+			return true;
+		}
+
+		char* buffer;           // read-only when mapped
+		size_t size;
+		bool mapped;
+
+		const KernelFileHeader* header;
+		const char* records;
+		uint32_t recordSize;
+		uint64_t recordCount;
+		const char* strings;
+		uint64_t stringsSize;
+		const KernelFileBucket* buckets;
+		uint64_t bucketCount;
+		const char* launchGaps;
+		uint32_t launchGapSize;
+		uint64_t launchGapCount;
+		const char* kernelChains;
+		uint32_t kernelChainSize;
+		uint64_t kernelChainCount;
+
+		double totalExecuteTime;
+		std::vector<KernelPerformanceInfo*> legacyKernels;
+};
+
+// Kernels of many files merged on name and region path. A merged kernel is
+// found through a hash of its name and path, so merging costs O(records)
+// however many kernels were seen. The kernels are constructed in blocks
+// owned by the table and live as long as it does.
+#define KERNEL_MERGE_BLOCK 256
+
+class KernelMergeTable {
+	public:
+		KernelMergeTable() : blockUsed(KERNEL_MERGE_BLOCK) {}
+
+		~KernelMergeTable() {
+			for(auto kernel_itr = kernels.begin(); kernel_itr != kernels.end(); kernel_itr++) {
+				(*kernel_itr)->~KernelPerformanceInfo();
+			}
+
+			for(auto block_itr = blocks.begin(); block_itr != blocks.end(); block_itr++) {
+				free(*block_itr);
+			}
+		}
+
+		// The merged kernel of a name and path, NULL when not seen
+		KernelPerformanceInfo* find(const char* name, const std::string& regionPath) const {
+			auto range = table.equal_range(hashKey(name, regionPath));
+
+			for(auto kernel_itr = range.first; kernel_itr != range.second; kernel_itr++) {
+				if(strcmp(kernel_itr->second->getName(), name) == 0 &&
+					kernel_itr->second->getRegionPath() == regionPath) {
+					return kernel_itr->second;
+				}
+			}
+
+			return NULL;
+		}
+
+		// The merged kernel of a name and path, created on first use
+		KernelPerformanceInfo* get(const char* name, const std::string& regionPath,
+			const KernelExecutionType kType) {
+
+			KernelPerformanceInfo* found = find(name, regionPath);
+			if(NULL != found) {
+				return found;
+			}
+
+			if(KERNEL_MERGE_BLOCK == blockUsed) {
+				blocks.push_back((char*) malloc(KERNEL_MERGE_BLOCK * sizeof(KernelPerformanceInfo)));
+				blockUsed = 0;
+			}
+
+			KernelPerformanceInfo* kernel = new (blocks.back() + blockUsed++ * sizeof(KernelPerformanceInfo))
+				KernelPerformanceInfo(name, kType);
+			kernel->setRegionPath(regionPath, 0);
+
+			table.insert(std::make_pair(hashKey(name, regionPath), kernel));
+			kernels.push_back(kernel);
+
+			return kernel;
+		}
+
+		// In the order they were first seen
+		const std::vector<KernelPerformanceInfo*>& getKernels() const {
+			return kernels;
+		}
+
+	private:
+		static uint64_t hashKey(const char* name, const std::string& regionPath) {
+			return hashName(regionPath.c_str(), hashName(";", hashName(name)));
+		}
+
+		KernelMergeTable(const KernelMergeTable&);
+		KernelMergeTable& operator=(const KernelMergeTable&);
+
+		std::unordered_multimap<uint64_t, KernelPerformanceInfo*> table;
+		std::vector<KernelPerformanceInfo*> kernels;
+		std::vector<char*> blocks;
+		size_t blockUsed;
+};
+
+// Snapshot stream written next to the .dat file when periodic snapshots
+// are enabled. After the header it is a sequence of chunks, appended and
+// flushed as the run goes, so a killed job keeps every completed snapshot:
+//
+//   NAME   - assigns an id to a kernel name and region path
+//   DELTA  - calls and time per kernel id since the thread's last snapshot
+//
+// Like the .dat file, times are in clock ticks.
+#define KERNEL_SNAPSHOT_VERSION 1
+
+struct KernelSnapshotHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t endianMarker;
+	int32_t rank;
+	uint32_t clockSource;
+	uint64_t pid;
+	double secondsPerTick;
+	uint64_t intervalTicks;
+	char hostname[64];
+};
+
+enum KernelSnapshotChunkType {
+	KERNEL_SNAPSHOT_NAME = 1,
+	KERNEL_SNAPSHOT_DELTA = 2
+};
+
+// Followed by size bytes of payload, a multiple of 8
+struct KernelSnapshotChunk {
+	uint32_t type;
+	uint32_t size;
+};
+
+// NAME payload, followed by the name and the region path, each
+// NUL-terminated
+struct KernelSnapshotName {
+	uint32_t id;
+	uint32_t kernelType;
+};
+
+// DELTA payload, followed by entryCount KernelSnapshotEntry
+struct KernelSnapshotDelta {
+	uint64_t interval;        // index of the interval the delta is reported for
+	uint64_t ticks;           // since tool initialization
+	uint32_t thread;
+	uint32_t entryCount;
+};
+
+struct KernelSnapshotEntry {
+	uint32_t id;
+	uint32_t reserved;
+	uint64_t callCount;
+	double time;
+};
+
+class KernelSnapshotWriter {
+	public:
+		KernelSnapshotWriter() : output(NULL) {}
+
+		bool open(const char* path, const uint64_t intervalTicks) {
+			output = fopen(path, "wb");
+			if(NULL == output) {
+				return false;
+			}
+
+			KernelSnapshotHeader header;
+			memset(&header, 0, sizeof(header));
+
+			memcpy(header.magic, KERNEL_SNAPSHOT_MAGIC, sizeof(header.magic));
+			header.version = KERNEL_SNAPSHOT_VERSION;
+			header.endianMarker = KERNEL_FILE_ENDIAN_MARKER;
+			header.rank = getLaunchRank();
+			header.clockSource = (uint32_t) clockSource;
+			header.pid = (uint64_t) getpid();
+			header.secondsPerTick = secondsPerTick;
+			header.intervalTicks = intervalTicks;
+			gethostname(header.hostname, sizeof(header.hostname) - 1);
+
+			fwrite(&header, sizeof(header), 1, output);
+			fflush(output);
+			return true;
+		}
+
+		bool isOpen() const {
+			return NULL != output;
+		}
+
+		void writeName(const uint32_t id, const KernelExecutionType kType,
+			const char* name, const char* path) {
+
+			const size_t nameLen = strlen(name) + 1;
+			const size_t pathLen = strlen(path) + 1;
+			const size_t textLen = nameLen + pathLen;
+			const size_t padding = (8 - (sizeof(KernelSnapshotName) + textLen) % 8) % 8;
+
+			KernelSnapshotChunk chunk;
+			chunk.type = KERNEL_SNAPSHOT_NAME;
+			chunk.size = (uint32_t) (sizeof(KernelSnapshotName) + textLen + padding);
+
+			KernelSnapshotName entry;
+			entry.id = id;
+			entry.kernelType = (uint32_t) kType;
+
+			const char zeros[8] = { 0 };
+
+			fwrite(&chunk, sizeof(chunk), 1, output);
+			fwrite(&entry, sizeof(entry), 1, output);
+			fwrite(name, 1, nameLen, output);
+			fwrite(path, 1, pathLen, output);
+			fwrite(zeros, 1, padding, output);
+		}
+
+		void writeDelta(const KernelSnapshotDelta& delta,
+			const std::vector<KernelSnapshotEntry>& entries) {
+
+			KernelSnapshotChunk chunk;
+			chunk.type = KERNEL_SNAPSHOT_DELTA;
+			chunk.size = (uint32_t) (sizeof(KernelSnapshotDelta) +
+				entries.size() * sizeof(KernelSnapshotEntry));
+
+			fwrite(&chunk, sizeof(chunk), 1, output);
+			fwrite(&delta, sizeof(delta), 1, output);
+
+			if(! entries.empty()) {
+				fwrite(&entries[0], sizeof(KernelSnapshotEntry), entries.size(), output);
+			}
+
+			fflush(output);
+		}
+
+		void close() {
+			if(NULL != output) {
+				fclose(output);
+				output = NULL;
+			}
+		}
+
+	private:
+		FILE* output;
+};
+
+// Decodes a snapshot stream; a chunk cut short by the process dying ends
+// the stream.
+class KernelSnapshotReader {
+	public:
+		struct Name {
+			std::string name;
+			std::string path;
+			KernelExecutionType kType;
+		};
+
+		struct Delta {
+			uint64_t interval;
+			uint32_t id;
+			uint64_t callCount;
+			double time;              // seconds
+		};
+
+		bool open(const char* path) {
+			names.clear();
+			deltas.clear();
+
+			FILE* input = fopen(path, "rb");
+			if(NULL == input) {
+				return false;
+			}
+
+			std::vector<char> buffer;
+			char block[65536];
+			size_t actual_read = 0;
+
+			while((actual_read = fread(block, 1, sizeof(block), input)) > 0) {
+				buffer.insert(buffer.end(), block, block + actual_read);
+			}
+
+			fclose(input);
+
+			if(buffer.size() < sizeof(KernelSnapshotHeader) ||
+				0 != memcmp(&buffer[0], KERNEL_SNAPSHOT_MAGIC, 8)) {
+				return false;
+			}
+
+			memcpy(&header, &buffer[0], sizeof(header));
+
+			if(header.endianMarker != KERNEL_FILE_ENDIAN_MARKER ||
+				header.version != KERNEL_SNAPSHOT_VERSION) {
+				fprintf(stderr, "%s: unsupported snapshot file\n", path);
+				return false;
+			}
+
+			size_t offset = sizeof(KernelSnapshotHeader);
+
+			while(offset + sizeof(KernelSnapshotChunk) <= buffer.size()) {
+				KernelSnapshotChunk chunk;
+				memcpy(&chunk, &buffer[offset], sizeof(chunk));
+				offset += sizeof(chunk);
+
+				if(chunk.size > buffer.size() - offset) {
+					break;
+				}
+
+				const char* payload = &buffer[offset];
+				offset += chunk.size;
+
+				if(chunk.type == KERNEL_SNAPSHOT_NAME && chunk.size > sizeof(KernelSnapshotName)) {
+					KernelSnapshotName entry;
+					memcpy(&entry, payload, sizeof(entry));
+
+					const char* text = payload + sizeof(entry);
+					const size_t textLen = chunk.size - sizeof(entry);
+					const size_t nameLen = strnlen(text, textLen);
+					if(nameLen + 1 >= textLen) break;
+
+					if(entry.id >= names.size()) {
+						names.resize(entry.id + 1);
+					}
+
+					names[entry.id].name = std::string(text, nameLen);
+					names[entry.id].path = std::string(text + nameLen + 1,
+						strnlen(text + nameLen + 1, textLen - nameLen - 1));
+					names[entry.id].kType = (KernelExecutionType) entry.kernelType;
+				} else if(chunk.type == KERNEL_SNAPSHOT_DELTA && chunk.size >= sizeof(KernelSnapshotDelta)) {
+					KernelSnapshotDelta delta;
+					memcpy(&delta, payload, sizeof(delta));
+
+					if(delta.entryCount > (chunk.size - sizeof(delta)) / sizeof(KernelSnapshotEntry)) {
+						break;
+					}
+
+					for(uint32_t i = 0; i < delta.entryCount; i++) {
+						KernelSnapshotEntry entry;
+						memcpy(&entry, payload + sizeof(delta) + i * sizeof(entry), sizeof(entry));
+
+						Delta decoded;
+						decoded.interval = delta.interval;
+						decoded.id = entry.id;
+						decoded.callCount = entry.callCount;
+						decoded.time = entry.time * header.secondsPerTick;
+						deltas.push_back(decoded);
+					}
+				}
+			}
+
+			return true;
+		}
+
+		double getInterval() const {
+			return header.intervalTicks * header.secondsPerTick;
+		}
+
+		const std::vector<Name>& getNames() const {
+			return names;
+		}
+
+		const std::vector<Delta>& getDeltas() const {
+			return deltas;
+		}
+
+	private:
+		KernelSnapshotHeader header;
+		std::vector<Name> names;
+		std::vector<Delta> deltas;
+};
+
+// Columnar export written by kp_reader --export, for loading merged
+// kernels into dataframes without parsing the text report. The header is
+// followed by columnCount KernelExportColumn descriptors, then each column
+// as one contiguous, 8-byte aligned array of rowCount values, then the
+// string table, so a loader can map the file and view every column in
+// place. STRING columns hold byte offsets of NUL-terminated strings in the
+// string table. Times are in seconds.
+#define KERNEL_EXPORT_MAGIC "KPKCOLMN"
+#define KERNEL_EXPORT_VERSION 1
+
+enum KernelExportColumnType {
+	KERNEL_EXPORT_UINT32 = 1,
+	KERNEL_EXPORT_UINT64 = 2,
+	KERNEL_EXPORT_FLOAT64 = 3,
+	KERNEL_EXPORT_STRING = 4        // uint32 offsets into the string table
+};
+
+struct KernelExportHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t endianMarker;
+	uint32_t headerSize;
+	uint32_t columnCount;
+	uint64_t rowCount;
+	uint64_t stringsOffset;
+	uint64_t stringsSize;
+	double totalExecuteTime;  // summed over the files read
+};
+
+struct KernelExportColumn {
+	char name[24];            // NUL-terminated
+	uint32_t type;            // KernelExportColumnType
+	uint32_t width;           // bytes per value
+	uint64_t offset;
+};
+
+class KernelExportWriter {
+	public:
+		KernelExportWriter(const uint64_t rows) : rowCount(rows) {}
+
+		// Byte offset of str in the string table
+		uint32_t internString(const char* str) {
+			const std::string key(str);
+			auto string_itr = stringOffsets.find(key);
+
+			if(string_itr != stringOffsets.end()) {
+				return string_itr->second;
+			}
+
+			const uint32_t offset = (uint32_t) strings.size();
+			strings.insert(strings.end(), str, str + key.size() + 1);
+			stringOffsets.insert(std::make_pair(key, offset));
+
+			return offset;
+		}
+
+		// values holds one entry per row
+		template<typename T>
+		void addColumn(const char* name, const KernelExportColumnType type,
+			const std::vector<T>& values) {
+
+			KernelExportColumn column;
+			memset(&column, 0, sizeof(column));
+
+			strncpy(column.name, name, sizeof(column.name) - 1);
+			column.type = (uint32_t) type;
+			column.width = sizeof(T);
+			columns.push_back(column);
+
+			const char* bytes = (const char*) values.data();
+			data.push_back(std::vector<char>(bytes, bytes + values.size() * sizeof(T)));
+		}
+
+		bool write(const char* path, const double totalExecuteTime) {
+			FILE* output = fopen(path, "wb");
+			if(NULL == output) {
+				return false;
+			}
+
+			KernelExportHeader header;
+			memset(&header, 0, sizeof(header));
+
+			memcpy(header.magic, KERNEL_EXPORT_MAGIC, sizeof(header.magic));
+			header.version = KERNEL_EXPORT_VERSION;
+			header.endianMarker = KERNEL_FILE_ENDIAN_MARKER;
+			header.headerSize = sizeof(KernelExportHeader);
+			header.columnCount = (uint32_t) columns.size();
+			header.rowCount = rowCount;
+			header.totalExecuteTime = totalExecuteTime;
+
+			// keep every column 8-byte aligned
+			uint64_t offset = sizeof(KernelExportHeader) + columns.size() * sizeof(KernelExportColumn);
+
+			for(size_t i = 0; i < columns.size(); i++) {
+				while(data[i].size() % 8 != 0) {
+					data[i].push_back('\0');
+				}
+
+				columns[i].offset = offset;
+				offset += data[i].size();
+			}
+
+			header.stringsOffset = offset;
+			header.stringsSize = strings.size();
+
+			bool success = (1 == fwrite(&header, sizeof(header), 1, output));
+			success = success && writeArray(output, columns);
+
+			for(size_t i = 0; i < data.size(); i++) {
+				success = success && writeArray(output, data[i]);
+			}
+
+			success = success && writeArray(output, strings);
+
+			return (0 == fclose(output)) && success;
+		}
+
+	private:
+		template<typename T>
+		bool writeArray(FILE* output, const std::vector<T>& values) {
+			return values.empty() ||
+				(values.size() == fwrite(&values[0], sizeof(T), values.size(), output));
+		}
+
+		uint64_t rowCount;
+		std::vector<KernelExportColumn> columns;
+		std::vector<std::vector<char> > data;
+		std::vector<char> strings;
+		std::unordered_map<std::string, uint32_t> stringOffsets;
+};
+
+#endif
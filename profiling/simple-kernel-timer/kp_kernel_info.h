@@ -44,9 +44,20 @@
 #define _H_KOKKOSP_KERNEL_INFO
 
 #include <stdio.h>
+#include <stdint.h>
 #include <sys/time.h>
+#include <time.h>
 #include <string>
 #include <cstring>
+#include <cmath>
+#include <limits>
+#include <unordered_map>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_RDTSC
+#include <cpuid.h>
+#include <x86intrin.h>
+#endif // __x86_64__ || __i386__
 
 #if defined(__GXX_ABI_VERSION)
 #define HAVE_GCC_ABI_DEMANGLE
@@ -69,30 +80,266 @@ char* demangleName(char* kernelName)
 	return kernelName;
 }
 
-double seconds() {
-	struct timeval now;
-	gettimeofday(&now, NULL);
+// Demangled names by the names as recorded. The files of a job repeat the
+// same names, so each is demangled at most once, when it is first printed.
+class DemangleCache {
+	public:
+		const char* get(const char* name) {
+			auto name_itr = names.find(name);
+
+			if(name_itr == names.end()) {
+				char* demangled = demangleName(strdup(name));
+				name_itr = names.insert(std::make_pair(std::string(name), std::string(demangled))).first;
+				free(demangled);
+			}
+
+			return name_itr->second.c_str();
+		}
+
+	private:
+		std::unordered_map<std::string, std::string> names;
+};
+
+// 64-bit FNV-1a hash of a kernel name; passing the hash of a prefix as
+// the seed continues hashing from there
+uint64_t hashName(const char* name, uint64_t hash = 14695981039346656037ULL) {
+
+	for(const char* c = name; *c != '\0'; c++) {
+		hash ^= (uint64_t) (unsigned char) *c;
+		hash *= 1099511628211ULL;
+	}
+
+	return hash;
+}
+
+// Clock used for kernel timestamps. Timestamps are integer ticks of the
+// selected source and are only converted to seconds on output.
+enum KernelTimerClock {
+	CLOCK_SOURCE_GETTIMEOFDAY = 0,
+	CLOCK_SOURCE_MONOTONIC_RAW = 1,
+	CLOCK_SOURCE_TSC = 2
+};
+
+static KernelTimerClock clockSource = CLOCK_SOURCE_MONOTONIC_RAW;
+static double secondsPerTick = 1.0e-9;
+
+uint64_t ticks() {
+	switch(clockSource) {
+#if defined(HAVE_RDTSC)
+	case CLOCK_SOURCE_TSC:
+		return __rdtsc();
+#endif // HAVE_RDTSC
+	case CLOCK_SOURCE_GETTIMEOFDAY: {
+		struct timeval now;
+		gettimeofday(&now, NULL);
+
+		return ((uint64_t) now.tv_sec) * 1000000ULL + (uint64_t) now.tv_usec;
+	}
+	default: {
+		// Where the kernel's vDSO supports CLOCK_MONOTONIC_RAW (Linux 5.3 and
+		// later on x86-64 and arm64) glibc reads it without a system call;
+		// elsewhere this is a system call
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC_RAW, &now);
+
+		return ((uint64_t) now.tv_sec) * 1000000000ULL + (uint64_t) now.tv_nsec;
+	}
+	}
+}
+
+double ticksToSeconds(const double t) {
+	return t * secondsPerTick;
+}
+
+#if defined(HAVE_RDTSC)
+bool hasInvariantTSC() {
+	unsigned int eax, ebx, ecx, edx;
+
+	if(0 == __get_cpuid(0x80000000, &eax, &ebx, &ecx, &edx) || eax < 0x80000007) {
+		return false;
+	}
+
+	__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx);
+	return (edx & (1 << 8)) != 0;
+}
+
+// Measure the TSC frequency against CLOCK_MONOTONIC_RAW over ~20ms
+double calibrateTSC() {
+	struct timespec start, now;
+	clock_gettime(CLOCK_MONOTONIC_RAW, &start);
+	const uint64_t tscStart = __rdtsc();
+
+	double elapsed = 0;
+	uint64_t tscEnd = tscStart;
+
+	while(elapsed < 0.02) {
+		clock_gettime(CLOCK_MONOTONIC_RAW, &now);
+		tscEnd = __rdtsc();
+
+		elapsed = (double) (now.tv_sec - start.tv_sec) +
+			(double) (now.tv_nsec - start.tv_nsec) * 1.0e-9;
+	}
+
+	return elapsed / (double) (tscEnd - tscStart);
+}
+#endif // HAVE_RDTSC
+
+// Select the clock by name ("monotonic", "tsc" or "gettimeofday"), falling
+// back to CLOCK_MONOTONIC_RAW when the request cannot be honoured. Returns
+// the name of the clock in use.
+const char* selectClock(const char* name) {
+	clockSource = CLOCK_SOURCE_MONOTONIC_RAW;
+	secondsPerTick = 1.0e-9;
+
+	if(NULL == name || 0 == strcmp(name, "") || 0 == strcmp(name, "monotonic")) {
+		return "monotonic";
+	}
+
+	if(0 == strcmp(name, "gettimeofday")) {
+		clockSource = CLOCK_SOURCE_GETTIMEOFDAY;
+		secondsPerTick = 1.0e-6;
+		return "gettimeofday";
+	}
+
+	if(0 == strcmp(name, "tsc")) {
+#if defined(HAVE_RDTSC)
+		if(hasInvariantTSC()) {
+			secondsPerTick = calibrateTSC();
+			clockSource = CLOCK_SOURCE_TSC;
+			return "tsc";
+		}
+#endif // HAVE_RDTSC
+		fprintf(stderr, "KokkosP: No invariant TSC available, using monotonic clock\n");
+		return "monotonic";
+	}
 
-	return (double) (now.tv_sec + (now.tv_usec * 1.0e-6));
+	fprintf(stderr, "KokkosP: Unknown clock \"%s\", using monotonic clock\n", name);
+	return "monotonic";
 }
 
+// Log-linear (HDR-style) histogram of invocation durations in nanoseconds.
+// Durations below 2^HISTOGRAM_SUB_BITS ns get a bucket each; above that,
+// every power of two is split into 2^HISTOGRAM_SUB_BITS linear sub-buckets,
+// so a bucket is never wider than 1/8th of its lower bound. Durations of
+// 2^(HISTOGRAM_MAX_EXPONENT + 1) ns (~37 minutes) and more share the last
+// bucket.
+#define HISTOGRAM_SUB_BITS 3
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_MAX_EXPONENT 40
+#define HISTOGRAM_BUCKETS ((HISTOGRAM_MAX_EXPONENT - HISTOGRAM_SUB_BITS + 2) * HISTOGRAM_SUB_BUCKETS)
+
+class KernelTimeHistogram {
+	public:
+		KernelTimeHistogram() {
+			memset(&counts[0], 0, HISTOGRAM_BUCKETS * sizeof(uint64_t));
+			maxValue = 0;
+		}
+
+		static uint32_t bucketIndex(const uint64_t ns) {
+			if(ns < HISTOGRAM_SUB_BUCKETS) {
+				return (uint32_t) ns;
+			}
+
+			const uint32_t exponent = 63 - __builtin_clzll(ns);
+			if(exponent > HISTOGRAM_MAX_EXPONENT) {
+				return HISTOGRAM_BUCKETS - 1;
+			}
+
+			const uint32_t subBucket = (uint32_t) (ns >> (exponent - HISTOGRAM_SUB_BITS)) &
+				(HISTOGRAM_SUB_BUCKETS - 1);
+			return (exponent - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS + subBucket;
+		}
+
+		// Largest duration (in ns) that falls into the bucket
+		static uint64_t bucketUpperBound(const uint32_t bucket) {
+			if(bucket < HISTOGRAM_SUB_BUCKETS) {
+				return bucket;
+			}
+
+			const uint32_t shift = bucket / HISTOGRAM_SUB_BUCKETS - 1;
+			const uint64_t lower = ((uint64_t) (HISTOGRAM_SUB_BUCKETS + bucket % HISTOGRAM_SUB_BUCKETS)) << shift;
+			return lower + (((uint64_t) 1) << shift) - 1;
+		}
+
+		void merge(const KernelTimeHistogram& other) {
+			for(uint32_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+				counts[i] += other.counts[i];
+			}
+
+			if(other.maxValue > maxValue) {
+				maxValue = other.maxValue;
+			}
+		}
+
+		uint64_t getTotalCount() const {
+			uint64_t total = 0;
+
+			for(uint32_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+				total += counts[i];
+			}
+
+			return total;
+		}
+
+		// Duration in seconds below which the given fraction of invocations
+		// fall, reported as the upper bound of the bucket (capped at the max)
+		double getPercentile(const double fraction) const {
+			const uint64_t total = getTotalCount();
+			if(0 == total) {
+				return 0;
+			}
+
+			uint64_t rank = (uint64_t) (fraction * (double) total + 0.5);
+			if(rank < 1) rank = 1;
+			if(rank > total) rank = total;
+
+			uint64_t seen = 0;
+			for(uint32_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+				seen += counts[i];
+
+				if(seen >= rank) {
+					const uint64_t upper = bucketUpperBound(i);
+					return ((upper < maxValue) ? upper : maxValue) * 1.0e-9;
+				}
+			}
+
+			return maxValue * 1.0e-9;
+		}
+
+		double getMax() const {
+			return maxValue * 1.0e-9;
+		}
+
+		uint64_t counts[HISTOGRAM_BUCKETS];
+		uint64_t maxValue;
+};
+
 enum KernelExecutionType {
 	PARALLEL_FOR = 0,
 	PARALLEL_REDUCE = 1,
 	PARALLEL_SCAN = 2,
-        REGION = 3
+        REGION = 3,
+	FENCE = 4,
+	DEEP_COPY = 5
 };
 
 class KernelPerformanceInfo {
 	public:
 		KernelPerformanceInfo(std::string kName, KernelExecutionType kernelType) :
-			kType(kernelType) {
+			selfTime(std::numeric_limits<double>::quiet_NaN()), bytes(0), rankCount(0), rankTime(0), rankM2(0),
+			rankMinTime(std::numeric_limits<double>::quiet_NaN()),
+			rankMaxTime(std::numeric_limits<double>::quiet_NaN()), rankMaxSource(NULL), rankMaxRank(-1),
+			timedCount(0), timeVariance(0), overhead(0), kType(kernelType), regionPathHash(0) {
 
 			kernelName = (char*) malloc(sizeof(char) * (kName.size() + 1));
 			strcpy(kernelName, kName.c_str());
 
 			callCount = 0;
 			time = 0;
+			mean = 0;
+			m2 = 0;
+			minTime = std::numeric_limits<double>::quiet_NaN();
+			maxTime = std::numeric_limits<double>::quiet_NaN();
 		}
 
 		~KernelPerformanceInfo() {
@@ -103,23 +350,179 @@ class KernelPerformanceInfo {
 			return kType;
 		}
 
-		void incrementCount() {
-			callCount++;
+		// Combines the statistics of two disjoint sets of invocations using
+		// the parallel variance formula of Chan et al.
+		void mergeStats(const uint64_t otherCount, const double otherTime,
+			const double otherM2, const double otherMinTime, const double otherMaxTime) {
+
+			const uint64_t totalCount = callCount + otherCount;
+
+			if(totalCount > 0) {
+				const double otherMean = (otherCount > 0) ? otherTime / (double) otherCount : 0;
+				const double delta = otherMean - mean;
+				const double thisWeight = (double) callCount / (double) totalCount;
+				const double otherWeight = (double) otherCount / (double) totalCount;
+
+				m2  += otherM2 + delta * delta * (double) callCount * otherWeight;
+				mean = mean * thisWeight + otherMean * otherWeight;
+			}
+
+			callCount = totalCount;
+			time     += otherTime;
+
+			minTime = fmin(minTime, otherMinTime);
+			maxTime = fmax(maxTime, otherMaxTime);
+		}
+
+		void merge(const KernelPerformanceInfo& other) {
+			mergeStats(other.callCount, other.time, other.m2, other.minTime, other.maxTime);
+			addSelfTime(other.selfTime);
+			bytes += other.bytes;
+			if(other.rankCount > 0 && ! (other.rankMaxTime <= rankMaxTime)) {
+				rankMaxSource = other.rankMaxSource;
+				rankMaxRank = other.rankMaxRank;
+			}
+			addRankStats(other.rankCount, other.rankTime, other.rankM2, other.rankMinTime,
+				other.rankMaxTime);
+			addSampling(other.timedCount, other.timeVariance);
+			overhead += other.overhead;
+
+			histogram.merge(other.histogram);
+		}
+
+		// Exclusive time of a region: not covered by child kernels or regions.
+		// NaN until some record carries it; files written before it was
+		// recorded leave it unknown rather than zero.
+		void addSelfTime(const double t) {
+			if(std::isnan(t)) return;
+
+			selfTime = std::isnan(selfTime) ? t : selfTime + t;
+		}
+
+		double getSelfTime() const {
+			return selfTime;
+		}
+
+		// Estimated time the tool spent in the callbacks of a kernel, or in
+		// the callbacks nested in a region
+		void addOverhead(const double t) {
+			overhead += t;
+		}
+
+		double getOverhead() const {
+			return overhead;
+		}
+
+		// Deep copies only: bytes moved over all calls
+		void addBytes(const uint64_t newBytes) {
+			bytes += newBytes;
+		}
+
+		uint64_t getBytes() const {
+			return bytes;
+		}
+
+		// Number of ranks (processes) that recorded the kernel, the sum and
+		// the sum of squared deviations of their total times, and the total
+		// time of the least and the most loaded of them. The deviations of two
+		// sets of ranks are combined as in mergeStats.
+		void addRankStats(const uint64_t ranks, const double total, const double m2Total,
+			const double minTotal, const double maxTotal) {
+
+			if(0 == ranks) return;
+
+			if(rankCount > 0) {
+				const double delta = total / (double) ranks - rankTime / (double) rankCount;
+				rankM2 += m2Total + delta * delta * (double) rankCount * (double) ranks /
+					(double) (rankCount + ranks);
+			} else {
+				rankM2 = m2Total;
+			}
+
+			rankCount += ranks;
+			rankTime += total;
+			rankMinTime = fmin(rankMinTime, minTotal);
+			rankMaxTime = fmax(rankMaxTime, maxTotal);
+		}
+
+		uint64_t getRankCount() const {
+			return rankCount;
+		}
+
+		double getRankM2() const {
+			return rankM2;
+		}
+
+		// Mean and sample standard deviation of the total time per rank
+		double getRankMeanTime() const {
+			return (rankCount > 0) ? rankTime / (double) rankCount : 0;
+		}
+
+		double getRankStdDev() const {
+			return (rankCount > 1) ? sqrt(rankM2 / (double) (rankCount - 1)) : 0;
+		}
+
+		double getRankMinTime() const {
+			return rankMinTime;
+		}
+
+		double getRankMaxTime() const {
+			return rankMaxTime;
+		}
+
+		// Most loaded rank over the average rank, 1 when balanced
+		double getRankImbalance() const {
+			return (rankCount > 0 && time > 0) ? rankMaxTime / (time / (double) rankCount) : 1.0;
+		}
+
+		// Time the most loaded rank spends in the kernel beyond the average
+		// rank: what the run would save were the kernel balanced
+		double getRankImbalanceCost() const {
+			return (rankCount > 1) ? rankMaxTime - getRankMeanTime() : 0;
+		}
+
+		// Where the most loaded rank was read from (a file name, not owned),
+		// NULL when unknown
+		void setRankMaxSource(const char* source) {
+			rankMaxSource = source;
+		}
+
+		const char* getRankMaxSource() const {
+			return rankMaxSource;
+		}
+
+		// MPI rank of the most loaded rank within its source, -1 when unknown
+		// (a file of one process, or ranks merged before it was recorded)
+		void setRankMaxRank(const int64_t rank) {
+			rankMaxRank = rank;
 		}
 
-		void addTime(double t) {
-			time   += t;
-			timeSq += (t*t);
+		int64_t getRankMaxRank() const {
+			return rankMaxRank;
 		}
 
-		void addFromTimer() {
-			addTime(seconds() - startTime);
+		// Invocations that were timed, and the variance of the total time
+		// estimated from them; the variance is 0 when every call was timed
+		void addSampling(const uint64_t timed, const double variance) {
+			timedCount += timed;
+			timeVariance += variance;
+		}
+
+		uint64_t getTimedCount() const {
+			return timedCount;
+		}
 
-			incrementCount();
+		double getTimeVariance() const {
+			return timeVariance;
 		}
 
-		void startTimer() {
-			startTime = seconds();
+		bool isSampled() const {
+			return timedCount < callCount;
+		}
+
+		// Half width of the 95% confidence interval of the total time
+		double getTimeError() const {
+			return 1.96 * sqrt(timeVariance);
 		}
 
 		uint64_t getCallCount() const {
@@ -130,41 +533,87 @@ class KernelPerformanceInfo {
 			return time;
 		}
 
-		double getTimeSq() {
-			return timeSq;
+		double getM2() const {
+			return m2;
+		}
+
+		double getMean() const {
+			return mean;
+		}
+
+		// Sample variance of the per-invocation time
+		double getVariance() const {
+			return (callCount > 1) ? m2 / (double) (callCount - 1) : 0;
+		}
+
+		double getStdDev() const {
+			return sqrt(getVariance());
+		}
+
+		// NaN when the record was read from a file that predates min/max
+		double getMinTime() const {
+			return minTime;
+		}
+
+		double getMaxTime() const {
+			return maxTime;
 		}
 
 		char* getName() const {
 			return kernelName;
 		}
 
-		void addCallCount(const uint64_t newCalls) {
-			callCount += newCalls;
+		const KernelTimeHistogram& getHistogram() const {
+			return histogram;
+		}
+
+		KernelTimeHistogram& getHistogram() {
+			return histogram;
+		}
+
+		// Enclosing regions, outermost first and separated by ';'. Empty
+		// unless the tool keys kernels by region path.
+		const std::string& getRegionPath() const {
+			return regionPath;
+		}
+
+		uint64_t getRegionPathHash() const {
+			return regionPathHash;
 		}
 
-		bool readFromFile(FILE* input) {
-			uint32_t recordLen = 0;
-			uint32_t actual_read = fread(&recordLen, sizeof(recordLen), 1, input);
-	                if(actual_read != 1) return false;
+		void setRegionPath(const std::string& path, const uint64_t pathHash) {
+			regionPath = path;
+			regionPathHash = pathHash;
+		}
 
-			char* entry = (char*) malloc(recordLen);
-                        fread(entry, recordLen, 1, input);
+		// Readers merge on the names as recorded and demangle for output
+		void demangle(DemangleCache& cache) {
+			const char* demangled = cache.get(kernelName);
 
+			free(kernelName);
+			kernelName = strdup(demangled);
+		}
+
+		// Decodes one record of the original (v1) file format, recordLen
+		// bytes after its length prefix, in place from the mapped file
+		bool readFromBuffer(const char* entry, const uint32_t recordLen) {
 			uint32_t nextIndex = 0;
 			uint32_t kernelNameLength;
+			if(recordLen < sizeof(kernelNameLength)) return false;
+
 			copy((char*) &kernelNameLength, &entry[nextIndex], sizeof(kernelNameLength));
 			nextIndex += sizeof(kernelNameLength);
 
-			if(strlen(kernelName) > 0) {
-				free(kernelName);
+			// name, call count, time, time squared and type
+			if((uint64_t) nextIndex + kernelNameLength + 3 * sizeof(uint64_t) + sizeof(uint32_t) > recordLen) {
+				return false;
 			}
 
+			free(kernelName);
 			kernelName = (char*) malloc( sizeof(char) * (kernelNameLength + 1));
 			copy(kernelName, &entry[nextIndex], kernelNameLength);
 			kernelName[kernelNameLength] = '\0';
 
-			kernelName = demangleName(kernelName);
-
 			nextIndex += kernelNameLength;
 
 			copy((char*) &callCount, &entry[nextIndex], sizeof(callCount));
@@ -173,9 +622,16 @@ class KernelPerformanceInfo {
 			copy((char*) &time, &entry[nextIndex], sizeof(time));
 			nextIndex += sizeof(time);
 
+			double timeSq = 0;
 			copy((char*) &timeSq, &entry[nextIndex], sizeof(timeSq));
 			nextIndex += sizeof(timeSq);
 
+			timedCount = callCount;
+			mean = (callCount > 0) ? time / (double) callCount : 0;
+			m2 = fmax(0.0, timeSq - (double) callCount * mean * mean);
+			minTime = std::numeric_limits<double>::quiet_NaN();
+			maxTime = std::numeric_limits<double>::quiet_NaN();
+
 			uint32_t kernelT = 0;
 			copy((char*) &kernelT, &entry[nextIndex], sizeof(kernelT));
 			nextIndex += sizeof(kernelT);
@@ -188,63 +644,83 @@ class KernelPerformanceInfo {
 				kType = PARALLEL_SCAN;
 			} else if(kernelT == 3) {
         kType = REGION;
-      }
+      } else if(kernelT == 4) {
+				kType = FENCE;
+			} else if(kernelT == 5) {
+				kType = DEEP_COPY;
+			}
 
-			free(entry);
-                        return true;
-		}
+			// Records written before histograms were added end here
+			if(nextIndex + sizeof(uint64_t) + sizeof(uint32_t) <= recordLen) {
+				copy((char*) &histogram.maxValue, &entry[nextIndex], sizeof(histogram.maxValue));
+				nextIndex += sizeof(histogram.maxValue);
 
-		void writeToFile(FILE* output) {
-			const uint32_t kernelNameLen = (uint32_t) strlen(kernelName);
+				uint32_t bucketCount = 0;
+				copy((char*) &bucketCount, &entry[nextIndex], sizeof(bucketCount));
+				nextIndex += sizeof(bucketCount);
 
-			const uint32_t recordLen =
-				sizeof(uint32_t) +
-				sizeof(char) * kernelNameLen +
-				sizeof(uint64_t) +
-				sizeof(double) +
-				sizeof(double) +
-				sizeof(uint32_t);
+				if(bucketCount > (recordLen - nextIndex) / (sizeof(uint32_t) + sizeof(uint64_t))) {
+					return false;
+				}
 
-			uint32_t nextIndex = 0;
-			char* entry = (char*) malloc(recordLen);
+				for(uint32_t i = 0; i < bucketCount; i++) {
+					uint32_t bucket = 0;
+					copy((char*) &bucket, &entry[nextIndex], sizeof(bucket));
+					nextIndex += sizeof(bucket);
 
-			copy(&entry[nextIndex], (char*) &kernelNameLen, sizeof(kernelNameLen));
-			nextIndex += sizeof(kernelNameLen);
+					uint64_t count = 0;
+					copy((char*) &count, &entry[nextIndex], sizeof(count));
+					nextIndex += sizeof(count);
 
-			copy(&entry[nextIndex], kernelName, kernelNameLen);
-			nextIndex += kernelNameLen;
-
-			copy(&entry[nextIndex], (char*) &callCount, sizeof(callCount));
-			nextIndex += sizeof(callCount);
+					if(bucket < HISTOGRAM_BUCKETS) {
+						histogram.counts[bucket] = count;
+					}
+				}
+			}
 
-			copy(&entry[nextIndex], (char*) &time, sizeof(time));
-			nextIndex += sizeof(time);
+			// Followed by the exact deviation sum and the extremes
+			if(nextIndex + 3 * sizeof(double) <= recordLen) {
+				copy((char*) &m2, &entry[nextIndex], sizeof(m2));
+				nextIndex += sizeof(m2);
 
-			copy(&entry[nextIndex], (char*) &timeSq, sizeof(timeSq));
-			nextIndex += sizeof(timeSq);
+				copy((char*) &minTime, &entry[nextIndex], sizeof(minTime));
+				nextIndex += sizeof(minTime);
 
-			uint32_t kernelTypeOutput = (uint32_t) kType;
-			copy(&entry[nextIndex], (char*) &kernelTypeOutput, sizeof(kernelTypeOutput));
-			nextIndex += sizeof(kernelTypeOutput);
+				copy((char*) &maxTime, &entry[nextIndex], sizeof(maxTime));
+				nextIndex += sizeof(maxTime);
+			}
 
-			fwrite(&recordLen, sizeof(uint32_t), 1, output);
-			fwrite(entry, recordLen, 1, output);
-			free(entry);
+			return true;
 		}
 
 	private:
 		void copy(char* dest, const char* src, uint32_t len) {
-			for(uint32_t i = 0; i < len; i++) {
-				dest[i] = src[i];
-			}
+			memcpy(dest, src, len);
 		}
 
 		char* kernelName;
 		uint64_t callCount;
 		double time;
-		double timeSq;
-		double startTime;
+		double mean;
+		double m2;
+		double minTime;
+		double maxTime;
+		double selfTime;
+		uint64_t bytes;
+		uint64_t rankCount;
+		double rankTime;
+		double rankM2;
+		double rankMinTime;
+		double rankMaxTime;
+		const char* rankMaxSource;
+		int64_t rankMaxRank;
+		uint64_t timedCount;
+		double timeVariance;
+		double overhead;
 		KernelExecutionType kType;
+		KernelTimeHistogram histogram;
+		std::string regionPath;
+		uint64_t regionPathHash;
 };
 
 #endif
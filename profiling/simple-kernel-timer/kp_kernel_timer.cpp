@@ -51,53 +51,673 @@
 #include <string>
 #include <sys/time.h>
 #include <iostream>
+#include <atomic>
+#include <mutex>
+#include <unordered_map>
 
 #include <unistd.h>
+
+// Build with -DUSE_MPI=1 (and mpicxx) to reduce the statistics of all ranks
+// into a single file at finalize
+#ifndef USE_MPI
+#define USE_MPI 0
+#endif
+
+#if USE_MPI
+#include <mpi.h>
+#endif
+
 #include "kp_kernel_info.h"
+#include "kp_kernel_file.h"
 
 bool compareKernelPerformanceInfo(KernelPerformanceInfo* left, KernelPerformanceInfo* right) {
 	return left->getTime() > right->getTime();
 };
 
-static uint64_t uniqID = 0;
-static KernelPerformanceInfo* currentEntry;
-static std::map<std::string, KernelPerformanceInfo*> count_map;
-static double initTime;
+static std::atomic<uint64_t> uniqID(0);
+static uint64_t initTime;
 static char* outputDelimiter;
-static int current_region_level = 0;
-static KernelPerformanceInfo* regions[512];
+
+// With KOKKOSP_KERNEL_TIMER_REGION_PATHS set, kernels and regions are
+// keyed on their name plus the path of enclosing regions, so the same
+// kernel called from different phases gets separate records.
+static bool region_paths = false;
+
+// All records live in the arena, which maps the output file, so that the
+// statistics survive the job being killed. Each record keeps when its last
+// call ended, from which a reader recovers the run time of a killed job.
+#define KERNEL_TIMER_ARENA_RECORDS 8192
+
+static KernelFileArena arena;
 
 #define MAX_STACK_SIZE 128
 
-void increment_counter(const char* name, KernelExecutionType kType) {
-	std::string nameStr(name);
+// With KOKKOSP_KERNEL_TIMER_SNAPSHOT_INTERVAL set to a number of seconds,
+// each host thread appends the calls and time its kernels accumulated since
+// its previous snapshot to a snapshot stream once per interval. A thread only
+// checks the clock it already read at the end of a kernel or region, so an
+// idle thread reports its delta at its next callback or at finalize.
+static uint64_t snapshot_interval = 0;
+static std::mutex snapshot_lock;
+static KernelSnapshotWriter snapshot_writer;
+static std::map<std::pair<std::string, std::string>, uint32_t> snapshot_ids;
+
+struct KernelSnapshotState {
+	uint32_t id;
+	uint64_t callCount;
+	double time;
+};
+
+// Start times of kernels that are in flight, keyed by the kID we hand back
+// to Kokkos, so that overlapping kernels (several host threads, async
+// execution space instances) do not clobber each other. A slot is claimed
+// lock-free by storing kID + 1 (0 marks a free slot); if the slot is still
+// held by an older kernel that has not ended yet, the start time goes into
+// a locked overflow map instead.
+#define KERNEL_TIMER_SLOTS 4096
+
+struct KernelTimerStart {
+	KernelArenaRecord* info;
+	uint64_t startTime;
+	uint32_t weight;          // invocations the timed one stands for
+};
+
+struct KernelTimerSlot {
+	std::atomic<uint64_t> kID;
+	KernelTimerStart start;
+};
+
+static KernelTimerSlot inflight_kernels[KERNEL_TIMER_SLOTS];
+static std::mutex inflight_overflow_lock;
+static std::unordered_map<uint64_t, KernelTimerStart> inflight_overflow;
+
+// With KOKKOSP_KERNEL_TIMER_SAMPLING_BUDGET set to a fraction of kernel
+// time, kernels timed sampling_warmup times go on to time one in K of their
+// invocations on average; the rest are counted with no clock read. K is set
+// per kernel from its mean time, so that the cost of the clock reads stays
+// within the budget: sampling_cost is that cost per timed call in ticks,
+// divided by the budget. Untimed invocations carry KERNEL_UNTIMED_ID in
+// their kID. The enclosing region does not see them as children, so its
+// self time includes them.
+#define KERNEL_UNTIMED_ID (1ULL << 63)
+
+static double sampling_cost = 0;
+static uint64_t sampling_warmup = 1000;
+
+// Cost of the tool's own callbacks in ticks, calibrated at initialization:
+// a timed kernel's begin and end callbacks in all (kernel_overhead) and the
+// part of it outside the kernel's timed window (kernel_outside), an untimed
+// kernel's callbacks, and a region's push and pop. Every kernel is charged
+// its callbacks, every region the callbacks nested in it. With
+// KOKKOSP_KERNEL_TIMER_SUBTRACT_OVERHEAD set, that charge is taken off the
+// region's time, and the part of its direct children's callbacks outside
+// their windows off its self time.
+static double kernel_overhead = 0;
+static double kernel_outside = 0;
+static double untimed_overhead = 0;
+static double region_overhead = 0;
+static double region_outside = 0;
+static bool subtract_overhead = false;
+
+// Kernel statistics are kept per host thread so that concurrent launches
+// never touch the same map or record; kokkosp_finalize_library merges the
+// shards. Kokkos calls the begin and end callbacks of a kernel from the
+// thread that launched it, so each record is only ever updated by the
+// thread owning its shard. Shards are never freed, which keeps the data of
+// threads that exit before finalize.
+//
+// Names are interned per shard. Kokkos labels almost always live in stable
+// storage, so a direct-mapped cache keyed on the incoming pointer resolves
+// the steady state with one probe and no allocation. The cached record's
+// name is compared against the label, since a temporary label buffer may be
+// reused for a different name. Misses fall back to a content hash.
+#define NAME_CACHE_SIZE 1024
+
+struct NameCacheEntry {
+	const char* name;
+	KernelArenaRecord* info;
+};
+
+// A region on the stack of one host thread. Child kernels and regions may
+// overlap (async kernels), so the time they cover is accumulated per run of
+// overlapping children: from the first child starting while none are
+// active to the last one ending.
+struct RegionFrame {
+	KernelArenaRecord* info;
+	uint64_t startTime;
+	uint64_t pathHash;       // path including this region, 0 without paths
+	uint64_t childTime;
+	uint64_t childStart;
+	uint32_t activeChildren;
+	double childOverhead;    // callbacks nested in the region
+	double selfOverhead;     // of those, outside the windows of direct children
+};
+
+// Kokkos hands out no id for a deep copy; it ends on the thread that
+// started it, after any copy nested inside it.
+struct DeepCopyFrame {
+	KernelArenaRecord* info;
+	uint64_t startTime;
+	uint64_t bytes;
+};
+
+// Host time between the end of one kernel and the begin of the next on the
+// same thread, per pair of kernels. Fences and deep copies count as kernels
+// here, so a gap is time the host spends in the application's own code.
+// An untimed (sampled) kernel breaks the chain, as its end is not known.
+struct LaunchGap {
+	uint64_t count;
+	double time;
+	double maxTime;
+};
+
+struct LaunchGapKeyHash {
+	template<typename T>
+	size_t operator()(const std::pair<T*, T*>& key) const {
+		return std::hash<uintptr_t>()((uintptr_t) key.first * 31 + (uintptr_t) key.second);
+	}
+};
+
+// Runs of 2 to KERNEL_CHAIN_MAX consecutive kernels launched by one host
+// thread inside the same region, the candidates for fusing into one kernel.
+// Fences do not end a run; a deep copy, a region push or pop and an untimed
+// (sampled) kernel do.
+template<typename T>
+struct KernelChainKey {
+	T* kernels[KERNEL_CHAIN_MAX];      // NULL past the end of the run
+
+	bool operator==(const KernelChainKey& other) const {
+		return 0 == memcmp(kernels, other.kernels, sizeof(kernels));
+	}
+};
+
+struct KernelChainKeyHash {
+	template<typename T>
+	size_t operator()(const KernelChainKey<T>& key) const {
+		uintptr_t hash = 0;
+		for(int i = 0; i < KERNEL_CHAIN_MAX; i++) {
+			hash = hash * 31 + (uintptr_t) key.kernels[i];
+		}
+
+		return std::hash<uintptr_t>()(hash);
+	}
+};
+
+struct KernelChain {
+	uint64_t count;
+	double time;
+};
+
+struct KernelStatsShard {
+	NameCacheEntry name_cache[NAME_CACHE_SIZE];
+	std::unordered_multimap<uint64_t, KernelArenaRecord*> name_table;
+	std::vector<KernelArenaRecord*> kernels;
+
+	// Popped frames stay in the vector above regionDepth, so an unbalanced
+	// pop can still name the regions seen last.
+	std::vector<RegionFrame> regionStack;
+	size_t regionDepth;
+
+	std::vector<DeepCopyFrame> deepCopies;
+	std::string deepCopyName;
+
+	KernelArenaRecord* lastKernel;
+	uint64_t lastKernelEnd;
+	std::unordered_map<std::pair<KernelArenaRecord*, KernelArenaRecord*>, LaunchGap,
+		LaunchGapKeyHash> launchGaps;
+
+	// the run so far, oldest first, and the times of its kernels
+	KernelArenaRecord* chainKernels[KERNEL_CHAIN_MAX - 1];
+	double chainTimes[KERNEL_CHAIN_MAX - 1];
+	uint32_t chainLength;
+	std::unordered_map<KernelChainKey<KernelArenaRecord>, KernelChain, KernelChainKeyHash> chains;
+
+	// what the last snapshot saw, parallel to kernels
+	std::vector<KernelSnapshotState> snapshotState;
+	uint64_t nextSnapshot;
+	uint32_t index;
+
+	KernelStatsShard() : regionDepth(0), lastKernel(NULL), lastKernelEnd(0), chainLength(0),
+		nextSnapshot(0), index(0) {
+		memset(&name_cache[0], 0, NAME_CACHE_SIZE * sizeof(NameCacheEntry));
+	}
+};
+
+static std::mutex shard_lock;
+static std::vector<KernelStatsShard*> shards;
+static thread_local KernelStatsShard* local_shard = NULL;
+
+KernelStatsShard* get_local_shard() {
+	if(NULL == local_shard) {
+		local_shard = new KernelStatsShard();
+		local_shard->nextSnapshot = initTime + snapshot_interval;
+
+		std::lock_guard<std::mutex> lock(shard_lock);
+		local_shard->index = (uint32_t) shards.size();
+		shards.push_back(local_shard);
+	}
+
+	return local_shard;
+}
+
+uint64_t current_region_path_hash(const KernelStatsShard* shard) {
+	return (0 == shard->regionDepth) ? 0 : shard->regionStack[shard->regionDepth - 1].pathHash;
+}
+
+std::string current_region_path(const KernelStatsShard* shard) {
+	std::string path;
+
+	for(size_t i = 0; i < shard->regionDepth; i++) {
+		if(i > 0) path += ";";
+		path += shard->regionStack[i].info->getName();
+	}
+
+	return path;
+}
+
+KernelArenaRecord* increment_counter(const char* name, KernelExecutionType kType) {
+	KernelStatsShard* shard = get_local_shard();
+	const uint64_t pathHash = current_region_path_hash(shard);
+
+	const uintptr_t namePtr = (uintptr_t) name;
+	NameCacheEntry& cached = shard->name_cache[((namePtr >> 3) ^ (namePtr >> 13) ^ pathHash) % NAME_CACHE_SIZE];
+
+	if(cached.name == name && cached.info->getRegionPathHash() == pathHash &&
+		strcmp(cached.info->getName(), name) == 0) {
+		return cached.info;
+	}
+
+	const uint64_t nameHash = hashName(name) ^ pathHash;
+	auto range = shard->name_table.equal_range(nameHash);
+	KernelArenaRecord* info = NULL;
+
+	for(auto kernel_itr = range.first; kernel_itr != range.second; kernel_itr++) {
+		if(kernel_itr->second->getRegionPathHash() == pathHash &&
+			strcmp(kernel_itr->second->getName(), name) == 0) {
+			info = kernel_itr->second;
+			break;
+		}
+	}
+
+	if(NULL == info) {
+		info = arena.addRecord(name, (0 == pathHash) ? "" : current_region_path(shard).c_str(),
+			pathHash, kType);
+
+		shard->name_table.insert(std::make_pair(nameHash, info));
+		shard->kernels.push_back(info);
+	}
+
+	cached.name = name;
+	cached.info = info;
+
+	return info;
+}
+
+// Appends what the shard's kernels accumulated since its last snapshot
+void write_snapshot(KernelStatsShard* shard, const uint64_t now) {
+	std::lock_guard<std::mutex> lock(snapshot_lock);
+
+	if(! snapshot_writer.isOpen()) return;
+
+	const uint64_t elapsed = now - initTime;
+	std::vector<KernelSnapshotEntry> entries;
+
+	for(size_t i = 0; i < shard->kernels.size(); i++) {
+		const KernelArenaRecord* info = shard->kernels[i];
+
+		if(i == shard->snapshotState.size()) {
+			const std::pair<std::string, std::string> kernelKey(info->getName(),
+				info->getRegionPath());
+			auto id_itr = snapshot_ids.find(kernelKey);
+
+			if(id_itr == snapshot_ids.end()) {
+				id_itr = snapshot_ids.insert(std::make_pair(kernelKey,
+					(uint32_t) snapshot_ids.size())).first;
+				snapshot_writer.writeName(id_itr->second, info->getKernelType(),
+					info->getName(), info->getRegionPath());
+			}
+
+			KernelSnapshotState state;
+			state.id = id_itr->second;
+			state.callCount = 0;
+			state.time = 0;
+			shard->snapshotState.push_back(state);
+		}
+
+		KernelSnapshotState& state = shard->snapshotState[i];
+
+		if(info->getCallCount() == state.callCount) continue;
+
+		KernelSnapshotEntry entry;
+		entry.id = state.id;
+		entry.reserved = 0;
+		entry.callCount = info->getCallCount() - state.callCount;
+		entry.time = info->getTime() - state.time;
+		entries.push_back(entry);
+
+		state.callCount = info->getCallCount();
+		state.time = info->getTime();
+	}
+
+	// A snapshot due at an interval boundary reports the interval that just
+	// completed; the one written at finalize reports the partial interval.
+	const uint64_t interval = elapsed / snapshot_interval;
+
+	KernelSnapshotDelta delta;
+	delta.interval = (now >= shard->nextSnapshot && interval > 0) ? interval - 1 : interval;
+	delta.ticks = elapsed;
+	delta.thread = shard->index;
+	delta.entryCount = (uint32_t) entries.size();
+
+	if(! entries.empty()) {
+		snapshot_writer.writeDelta(delta, entries);
+	}
+
+	shard->nextSnapshot = initTime + (interval + 1) * snapshot_interval;
+}
+
+// At the end of a call of info
+inline void check_periodic(KernelStatsShard* shard, KernelArenaRecord* info, const uint64_t now) {
+	info->setEndTicks(now - initTime);
+
+	if(0 != snapshot_interval && now >= shard->nextSnapshot) {
+		write_snapshot(shard, now);
+	}
+}
+
+void begin_launch_gap_child(KernelStatsShard* shard, KernelArenaRecord* info,
+	const uint64_t startTime) {
+
+	if(NULL == shard->lastKernel || startTime <= shard->lastKernelEnd) return;
 
-	if(count_map.find(name) == count_map.end()) {
-		KernelPerformanceInfo* info = new KernelPerformanceInfo(nameStr, kType);
-		count_map.insert(std::pair<std::string, KernelPerformanceInfo*>(nameStr, info));
+	double gap = (double) (startTime - shard->lastKernelEnd);
+	if(subtract_overhead) {
+		gap = fmax(gap - kernel_outside, 0.0);
+	}
+
+	LaunchGap& launchGap = shard->launchGaps[std::make_pair(shard->lastKernel, info)];
+	launchGap.count++;
+	launchGap.time += gap;
+	launchGap.maxTime = fmax(launchGap.maxTime, gap);
+}
+
+inline void end_launch_gap_child(KernelStatsShard* shard, KernelArenaRecord* info,
+	const uint64_t endTime) {
+
+	shard->lastKernel = info;
+	shard->lastKernelEnd = endTime;
+}
+
+// Counts the runs ending in a kernel that took time ticks
+void end_chain_child(KernelStatsShard* shard, KernelArenaRecord* info, const double time) {
+	if(FENCE == info->getKernelType()) return;
+
+	double chainTime = time;
+
+	for(uint32_t n = 1; n <= shard->chainLength; n++) {
+		KernelChainKey<KernelArenaRecord> key;
+		memset(&key, 0, sizeof(key));
+
+		for(uint32_t i = 0; i < n; i++) {
+			key.kernels[i] = shard->chainKernels[shard->chainLength - n + i];
+		}
+
+		key.kernels[n] = info;
+		chainTime += shard->chainTimes[shard->chainLength - n];
+
+		KernelChain& chain = shard->chains[key];
+		chain.count++;
+		chain.time += chainTime;
+	}
+
+	if(shard->chainLength == KERNEL_CHAIN_MAX - 1) {
+		for(uint32_t i = 1; i < shard->chainLength; i++) {
+			shard->chainKernels[i - 1] = shard->chainKernels[i];
+			shard->chainTimes[i - 1] = shard->chainTimes[i];
+		}
+
+		shard->chainLength--;
+	}
+
+	shard->chainKernels[shard->chainLength] = info;
+	shard->chainTimes[shard->chainLength] = time;
+	shard->chainLength++;
+}
+
+// A kernel or region starting or ending inside the innermost region
+void begin_region_child(KernelStatsShard* shard, const uint64_t now) {
+	if(0 == shard->regionDepth) return;
+
+	RegionFrame& parent = shard->regionStack[shard->regionDepth - 1];
+	if(0 == parent.activeChildren++) {
+		parent.childStart = now;
+	}
+}
+
+// overhead is the cost of the child's callbacks and of those nested in it,
+// outside the part that is not covered by the child's own time
+void end_region_child(KernelStatsShard* shard, const uint64_t now,
+	const double overhead, const double outside) {
+
+	if(0 == shard->regionDepth) return;
+
+	RegionFrame& parent = shard->regionStack[shard->regionDepth - 1];
+	if(parent.activeChildren > 0 && 0 == --parent.activeChildren) {
+		parent.childTime += now - parent.childStart;
+	}
+
+	parent.childOverhead += overhead;
+	parent.selfOverhead += outside;
+}
+
+void start_kernel_timer(const uint64_t kID, KernelArenaRecord* info, const uint32_t weight = 1) {
+	KernelTimerSlot& slot = inflight_kernels[kID % KERNEL_TIMER_SLOTS];
+	uint64_t freeSlot = 0;
+	const uint64_t startTime = ticks();
+	KernelStatsShard* shard = get_local_shard();
+
+	begin_region_child(shard, startTime);
+	begin_launch_gap_child(shard, info, startTime);
+
+	KernelTimerStart start;
+	start.info = info;
+	start.startTime = startTime;
+	start.weight = weight;
+
+	if(slot.kID.compare_exchange_strong(freeSlot, kID + 1, std::memory_order_acquire)) {
+		slot.start = start;
+	} else {
+		std::lock_guard<std::mutex> lock(inflight_overflow_lock);
+		inflight_overflow[kID] = start;
+	}
+}
+
+// Hands out the kID of a kernel invocation and times it, unless sampling
+// leaves it untimed
+void begin_kernel(uint64_t* kID, KernelArenaRecord* info) {
+	*kID = uniqID++;
+
+	if(0 == sampling_cost) {
+		start_kernel_timer(*kID, info);
+		return;
+	}
+
+	const uint32_t weight = info->sampleInvocation();
+
+	if(0 == weight) {
+		*kID |= KERNEL_UNTIMED_ID;
+		info->addOverhead(untimed_overhead);
+
+		KernelStatsShard* shard = get_local_shard();
+		shard->lastKernel = NULL;
+		shard->chainLength = 0;
+
+		if(shard->regionDepth > 0) {
+			shard->regionStack[shard->regionDepth - 1].childOverhead += untimed_overhead;
+			shard->regionStack[shard->regionDepth - 1].selfOverhead += untimed_overhead;
+		}
+	} else {
+		start_kernel_timer(*kID, info, weight);
+	}
+}
+
+// Picks the period of the kernel's next timed invocations
+void update_sample_period(KernelArenaRecord* info) {
+	if(info->getTimedCount() < sampling_warmup) return;
+
+	const double meanTime = info->getTime() / (double) info->getCallCount();
+	const double period = (meanTime > 0) ? sampling_cost / meanTime : KERNEL_SAMPLE_PERIOD_MAX;
 
-		currentEntry = info;
+	info->setSamplePeriod((period < 1) ? 1 :
+		((period > KERNEL_SAMPLE_PERIOD_MAX) ? KERNEL_SAMPLE_PERIOD_MAX : (uint32_t) period));
+}
+
+void stop_kernel_timer(const uint64_t kID) {
+	if(kID & KERNEL_UNTIMED_ID) return;
+
+	const uint64_t endTime = ticks();
+	KernelTimerSlot& slot = inflight_kernels[kID % KERNEL_TIMER_SLOTS];
+	KernelStatsShard* shard = get_local_shard();
+	KernelTimerStart start;
+
+	end_region_child(shard, endTime, kernel_overhead, kernel_outside);
+
+	if(slot.kID.load(std::memory_order_acquire) == kID + 1) {
+		start = slot.start;
+		slot.kID.store(0, std::memory_order_release);
 	} else {
-		currentEntry = count_map[nameStr];
+		std::lock_guard<std::mutex> lock(inflight_overflow_lock);
+		auto overflow_itr = inflight_overflow.find(kID);
+
+		if(overflow_itr == inflight_overflow.end()) {
+			fprintf(stderr, "KokkosP: Warning: end of kernel %llu which was never started\n",
+				(unsigned long long) kID);
+			return;
+		}
+
+		start = overflow_itr->second;
+		inflight_overflow.erase(overflow_itr);
+	}
+
+	start.info->addTime((double) (endTime - start.startTime), start.weight);
+	start.info->addOverhead(kernel_overhead);
+	end_launch_gap_child(shard, start.info, endTime);
+	end_chain_child(shard, start.info, (double) (endTime - start.startTime));
+
+	if(0 != sampling_cost) {
+		update_sample_period(start.info);
 	}
 
-	currentEntry->startTimer();
+	check_periodic(shard, start.info, endTime);
 }
 
 void increment_counter_region(const char* name, KernelExecutionType kType) {
-        std::string nameStr(name);
+	KernelStatsShard* shard = get_local_shard();
+	KernelArenaRecord* info = increment_counter(name, kType);
+	const uint64_t parentPathHash = current_region_path_hash(shard);
+	const uint64_t startTime = ticks();
 
-        if(count_map.find(name) == count_map.end()) {
-                KernelPerformanceInfo* info = new KernelPerformanceInfo(nameStr, kType);
-                count_map.insert(std::pair<std::string, KernelPerformanceInfo*>(nameStr, info));
+	begin_region_child(shard, startTime);
+	shard->chainLength = 0;
 
-                regions[current_region_level] = info;
-        } else {
-                regions[current_region_level] = count_map[nameStr];
-        }
+	if(shard->regionDepth == shard->regionStack.size()) {
+		shard->regionStack.push_back(RegionFrame());
+	}
 
-        regions[current_region_level]->startTimer();
-        current_region_level++;
+	RegionFrame& frame = shard->regionStack[shard->regionDepth++];
+	frame.info = info;
+	frame.startTime = startTime;
+	frame.pathHash = region_paths ? hashName(name, hashName(";", parentPathHash)) : 0;
+	frame.childTime = 0;
+	frame.childStart = 0;
+	frame.activeChildren = 0;
+	frame.childOverhead = 0;
+	frame.selfOverhead = 0;
+}
+
+void output_file_name(char* buffer, const size_t size, const char* extension) {
+	char hostname[256];
+	gethostname(hostname, sizeof(hostname));
+
+	snprintf(buffer, size, "%s-%d.%s", hostname, (int) getpid(), extension);
+}
+
+extern "C" void kokkosp_begin_parallel_for(const char* name, const uint32_t devID, uint64_t* kID);
+extern "C" void kokkosp_end_parallel_for(const uint64_t kID);
+extern "C" void kokkosp_push_profile_region(char* regionName);
+extern "C" void kokkosp_pop_profile_region();
+
+// Times the callbacks on a throwaway shard. Runs before the arena is
+// opened, so the calibration records never reach the output.
+void calibrate_overhead() {
+	const int calibrationCalls = 10000;
+	KernelStatsShard calibrationShard;
+	local_shard = &calibrationShard;
+
+	uint64_t kID = 0;
+	static const char kernelName[] = "KokkosP calibration";
+	char regionName[] = "KokkosP calibration region";
+
+	// scratch records, found by the callbacks like any other, so that the
+	// calibration never reaches the arena or the report
+	KernelFileRecord scratchRecords[2];
+	std::vector<KernelFileBucket> scratchBuckets(2 * HISTOGRAM_BUCKETS);
+	memset(&scratchRecords[0], 0, sizeof(scratchRecords));
+	memset(&scratchBuckets[0], 0, scratchBuckets.size() * sizeof(KernelFileBucket));
+
+	KernelFileArena::initRecord(&scratchRecords[0], &scratchBuckets[0], PARALLEL_FOR);
+	KernelFileArena::initRecord(&scratchRecords[1], &scratchBuckets[HISTOGRAM_BUCKETS], REGION);
+
+	KernelArenaRecord kernel(&scratchRecords[0], &scratchBuckets[0], kernelName, "", 0);
+	KernelArenaRecord region(&scratchRecords[1], &scratchBuckets[HISTOGRAM_BUCKETS], regionName, "", 0);
+
+	calibrationShard.name_table.insert(std::make_pair(hashName(kernelName), &kernel));
+	calibrationShard.name_table.insert(std::make_pair(hashName(regionName), &region));
+	calibrationShard.kernels.push_back(&kernel);
+	calibrationShard.kernels.push_back(&region);
+
+	// the first pass warms up the caches
+	for(int pass = 0; pass < 2; pass++) {
+		const uint64_t kernelStart = ticks();
+		for(int i = 0; i < calibrationCalls; i++) {
+			kokkosp_begin_parallel_for(kernelName, 0, &kID);
+			kokkosp_end_parallel_for(kID);
+		}
+		kernel_overhead = (double) (ticks() - kernelStart) / calibrationCalls;
+
+		const uint64_t regionStart = ticks();
+		for(int i = 0; i < calibrationCalls; i++) {
+			kokkosp_push_profile_region(regionName);
+			kokkosp_pop_profile_region();
+		}
+		region_overhead = (double) (ticks() - regionStart) / calibrationCalls;
+	}
+
+	kernel_outside = fmax(kernel_overhead - kernel.getTime() / kernel.getCallCount(), 0.0);
+	region_outside = fmax(region_overhead - region.getTime() / region.getCallCount(), 0.0);
+
+	// Nearly every call of a kernel with the longest sample period is
+	// untimed. The period is pinned by keeping the kernel in its warmup,
+	// and the call drawn timed right after it is set is made before the
+	// clock starts.
+	const uint64_t warmup = sampling_warmup;
+	sampling_warmup = std::numeric_limits<uint64_t>::max();
+	sampling_cost = 1.0;
+	kernel.setSamplePeriod(KERNEL_SAMPLE_PERIOD_MAX);
+
+	kokkosp_begin_parallel_for(kernelName, 0, &kID);
+	kokkosp_end_parallel_for(kID);
+
+	const uint64_t untimedStart = ticks();
+	for(int i = 0; i < calibrationCalls; i++) {
+		kokkosp_begin_parallel_for(kernelName, 0, &kID);
+		kokkosp_end_parallel_for(kID);
+	}
+	untimed_overhead = (double) (ticks() - untimedStart) / calibrationCalls;
+
+	sampling_cost = 0;
+	sampling_warmup = warmup;
+	local_shard = NULL;
 }
 
 extern "C" void kokkosp_init_library(const int loadSeq,
@@ -114,37 +734,640 @@ extern "C" void kokkosp_init_library(const int loadSeq,
 		sprintf(outputDelimiter, "%s", output_delim_env);
 	}
 
-	// initialize regions to 0s so we know if there is an object there
-	memset(&regions[0], 0, 512 * sizeof(KernelPerformanceInfo*));
+	const char* clockName = selectClock(getenv("KOKKOSP_KERNEL_TIMER_CLOCK"));
+
+	const char* region_paths_env = getenv("KOKKOSP_KERNEL_TIMER_REGION_PATHS");
+	region_paths = (NULL != region_paths_env) && (0 != strcmp(region_paths_env, "0"));
 
 	printf("KokkosP: Example Library Initialized (sequence is %d, version: %llu)\n", loadSeq, interfaceVer);
+	printf("KokkosP: Kernel timer using %s clock\n", clockName);
+
+	if(region_paths) {
+		printf("KokkosP: Kernels are keyed by their region path\n");
+	}
+
+	calibrate_overhead();
+
+	const char* subtract_env = getenv("KOKKOSP_KERNEL_TIMER_SUBTRACT_OVERHEAD");
+	subtract_overhead = (NULL != subtract_env) && (0 != strcmp(subtract_env, "0"));
+
+	printf("KokkosP: Tool overhead per kernel call %f us, per region %f us%s\n",
+		ticksToSeconds(kernel_overhead) * 1.0e6, ticksToSeconds(region_overhead) * 1.0e6,
+		subtract_overhead ? ", subtracted from region times" : "");
+
+	const char* snapshot_env = getenv("KOKKOSP_KERNEL_TIMER_SNAPSHOT_INTERVAL");
+	const double snapshot_seconds = (NULL == snapshot_env) ? 0.0 : atof(snapshot_env);
+
+	if(snapshot_seconds > 0.0) {
+		snapshot_interval = (uint64_t) (snapshot_seconds / secondsPerTick);
+
+		char snapshotOutput[256];
+		output_file_name(snapshotOutput, sizeof(snapshotOutput), "kpsnap");
+
+		if(snapshot_interval > 0 && snapshot_writer.open(snapshotOutput, snapshot_interval)) {
+			printf("KokkosP: Writing snapshots every %f seconds to %s\n",
+				snapshot_seconds, snapshotOutput);
+		} else {
+			fprintf(stderr, "KokkosP: Error: unable to write snapshots to %s\n", snapshotOutput);
+			snapshot_interval = 0;
+		}
+	}
+
+	const char* sampling_env = getenv("KOKKOSP_KERNEL_TIMER_SAMPLING_BUDGET");
+	const double sampling_budget = (NULL == sampling_env) ? 0.0 : atof(sampling_env);
+
+	if(sampling_budget > 0.0) {
+		const char* warmup_env = getenv("KOKKOSP_KERNEL_TIMER_SAMPLING_WARMUP");
+		if(NULL != warmup_env) {
+			sampling_warmup = (uint64_t) atoll(warmup_env);
+		}
 
-	initTime = seconds();
+		// a timed invocation reads the clock twice
+		const int calibrationCalls = 10000;
+		const uint64_t calibrationStart = ticks();
+		for(int i = 0; i < calibrationCalls; i++) {
+			ticks();
+		}
+
+		const double clockCost = (double) (ticks() - calibrationStart) / (double) calibrationCalls;
+		sampling_cost = fmax(2.0 * clockCost, 1.0) / sampling_budget;
+
+		printf("KokkosP: Sampling kernels after %llu calls to keep timing within %f of "
+			"kernel time\n", (unsigned long long) sampling_warmup, sampling_budget);
+	}
+
+	const char* arena_records_env = getenv("KOKKOSP_KERNEL_TIMER_ARENA_RECORDS");
+	const int arena_records = (NULL == arena_records_env) ? KERNEL_TIMER_ARENA_RECORDS :
+		atoi(arena_records_env);
+
+	char arenaOutput[256];
+	output_file_name(arenaOutput, sizeof(arenaOutput), "dat");
+
+	if(arena_records > 0 && ! arena.open(arenaOutput, (uint64_t) arena_records)) {
+		fprintf(stderr, "KokkosP: Warning: unable to map %s, kernel timing is only "
+			"written at finalize\n", arenaOutput);
+	}
+
+	initTime = ticks();
+}
+
+#if USE_MPI
+// Statistics of one kernel during the reduction over ranks. Times are in
+// ns, since every rank may have calibrated a different clock.
+struct KernelRankStats {
+	uint64_t callCount;
+	double time;
+	double m2;
+	double minTime;
+	double maxTime;
+	double selfTime;
+	uint64_t bytes;
+	uint64_t ranks;           // 0 when no rank merged so far has the kernel
+	double rankM2;
+	double rankMinTime;
+	double rankMaxTime;
+	int64_t rankMaxRank;      // the rank whose total time is rankMaxTime
+	uint64_t histogramMax;
+	uint64_t timedCount;
+	double timeVariance;
+	double overhead;
+};
+
+void reduce_kernel_rank_stats(void* in, void* inout, int* len, MPI_Datatype* type) {
+	const KernelRankStats* from = (const KernelRankStats*) in;
+	KernelRankStats* into = (KernelRankStats*) inout;
+	for(int i = 0; i < *len; i++) {
+		const KernelRankStats& a = from[i];
+		KernelRankStats& b = into[i];
+
+		if(0 == a.ranks) continue;
+
+		if(0 == b.ranks) {
+			b = a;
+			continue;
+		}
+
+		// parallel variance formula of Chan et al., as in mergeStats
+		const uint64_t totalCount = a.callCount + b.callCount;
+
+		if(a.callCount > 0 && b.callCount > 0) {
+			const double delta = a.time / (double) a.callCount - b.time / (double) b.callCount;
+			b.m2 += a.m2 + delta * delta * (double) a.callCount * (double) b.callCount /
+				(double) totalCount;
+		} else {
+			b.m2 += a.m2;
+		}
+
+		// and over the total times of the ranks
+		const double rankDelta = a.time / (double) a.ranks - b.time / (double) b.ranks;
+		b.rankM2 += a.rankM2 + rankDelta * rankDelta * (double) a.ranks * (double) b.ranks /
+			(double) (a.ranks + b.ranks);
+
+		b.callCount = totalCount;
+		b.time += a.time;
+		b.minTime = fmin(b.minTime, a.minTime);
+		b.maxTime = fmax(b.maxTime, a.maxTime);
+		b.selfTime += a.selfTime;
+		b.bytes += a.bytes;
+		b.ranks += a.ranks;
+		b.rankMinTime = fmin(b.rankMinTime, a.rankMinTime);
+		if(! (a.rankMaxTime <= b.rankMaxTime)) b.rankMaxRank = a.rankMaxRank;
+		b.rankMaxTime = fmax(b.rankMaxTime, a.rankMaxTime);
+		b.histogramMax = std::max(b.histogramMax, a.histogramMax);
+		b.timedCount += a.timedCount;
+		b.timeVariance += a.timeVariance;
+		b.overhead += a.overhead;
+	}
 }
 
+// A launch gap sent to rank 0, between the kernels of two hashes
+struct KernelRankGap {
+	uint64_t prevHash;
+	uint64_t nextHash;
+	uint64_t count;
+	double time;
+	double maxTime;
+};
+
+// A run of kernels sent to rank 0, by the hashes of its kernels
+struct KernelRankChain {
+	uint64_t length;
+	uint64_t hashes[KERNEL_CHAIN_MAX];
+	uint64_t count;
+	double time;
+};
+
+// Identifies a kernel across ranks
+uint64_t kernel_key_hash(const std::pair<std::string, std::string>& kernelKey) {
+	return hashName(kernelKey.second.c_str(), hashName(";", hashName(kernelKey.first.c_str())));
+}
+
+// Reduces the kernels of all ranks onto rank 0, which writes them to
+// fileOutput; the other ranks remove their file. The ranks agree on the
+// kernels by gathering the hashes of their names and paths, and rank 0 is
+// only sent the names it has not seen itself. Returns false, with every
+// rank writing its own file, when MPI is not running or two kernels of a
+// rank share a hash.
+bool write_merged_file(std::map<std::pair<std::string, std::string>, KernelPerformanceInfo*>& count_map,
+	std::unordered_map<std::pair<KernelPerformanceInfo*, KernelPerformanceInfo*>, LaunchGap,
+		LaunchGapKeyHash>& gap_map,
+	std::unordered_map<KernelChainKey<KernelPerformanceInfo>, KernelChain, KernelChainKeyHash>& chain_map,
+	const uint64_t totalTicks, const char* fileOutput) {
+
+	int initialized = 0;
+	int finalized = 0;
+	MPI_Initialized(&initialized);
+	MPI_Finalized(&finalized);
+
+	if(! initialized || finalized) return false;
+
+	int rank = 0;
+	int size = 1;
+	MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+	MPI_Comm_size(MPI_COMM_WORLD, &size);
+
+	std::vector<std::pair<uint64_t, KernelPerformanceInfo*> > local;
+
+	for(auto kernel_itr = count_map.begin(); kernel_itr != count_map.end(); kernel_itr++) {
+		local.push_back(std::make_pair(kernel_key_hash(kernel_itr->first), kernel_itr->second));
+	}
+
+	std::sort(local.begin(), local.end());
+
+	int collision = 0;
+	for(size_t i = 1; i < local.size(); i++) {
+		if(local[i].first == local[i - 1].first) collision = 1;
+	}
+
+	MPI_Allreduce(MPI_IN_PLACE, &collision, 1, MPI_INT, MPI_MAX, MPI_COMM_WORLD);
+
+	if(collision) {
+		if(0 == rank) {
+			fprintf(stderr, "KokkosP: Warning: kernel names collide, each rank writes its own file\n");
+		}
+		return false;
+	}
+
+	std::vector<uint64_t> localHashes(local.size());
+	for(size_t i = 0; i < local.size(); i++) {
+		localHashes[i] = local[i].first;
+	}
+
+	const int localCount = (int) localHashes.size();
+	std::vector<int> counts(size);
+	std::vector<int> displs(size);
+	MPI_Allgather(&localCount, 1, MPI_INT, &counts[0], 1, MPI_INT, MPI_COMM_WORLD);
+
+	int gatheredCount = 0;
+	for(int r = 0; r < size; r++) {
+		displs[r] = gatheredCount;
+		gatheredCount += counts[r];
+	}
+
+	std::vector<uint64_t> gathered(std::max(gatheredCount, 1));
+	MPI_Allgatherv(localHashes.empty() ? NULL : &localHashes[0], localCount, MPI_UINT64_T,
+		&gathered[0], &counts[0], &displs[0], MPI_UINT64_T, MPI_COMM_WORLD);
+
+	// the first rank holding a kernel sends its name to rank 0
+	std::unordered_map<uint64_t, int> owners;
+	for(int r = 0; r < size; r++) {
+		for(int i = displs[r]; i < displs[r] + counts[r]; i++) {
+			owners.insert(std::make_pair(gathered[i], r));
+		}
+	}
+
+	std::vector<uint64_t> globalHashes;
+	for(auto owner_itr = owners.begin(); owner_itr != owners.end(); owner_itr++) {
+		globalHashes.push_back(owner_itr->first);
+	}
+
+	std::sort(globalHashes.begin(), globalHashes.end());
+
+	// names as hash, type, name and path, each NUL-terminated
+	std::vector<char> names;
+
+	for(size_t i = 0; i < local.size(); i++) {
+		if(0 == rank || owners[local[i].first] != rank) continue;
+
+		const KernelPerformanceInfo* info = local[i].second;
+		const uint32_t kType = (uint32_t) info->getKernelType();
+
+		names.insert(names.end(), (const char*) &local[i].first,
+			(const char*) &local[i].first + sizeof(uint64_t));
+		names.insert(names.end(), (const char*) &kType, (const char*) &kType + sizeof(uint32_t));
+		names.insert(names.end(), info->getName(), info->getName() + strlen(info->getName()) + 1);
+		names.insert(names.end(), info->getRegionPath().c_str(),
+			info->getRegionPath().c_str() + info->getRegionPath().size() + 1);
+	}
+
+	const int namesSize = (int) names.size();
+	MPI_Gather(&namesSize, 1, MPI_INT, &counts[0], 1, MPI_INT, 0, MPI_COMM_WORLD);
+
+	int gatheredNamesSize = 0;
+	for(int r = 0; r < size; r++) {
+		displs[r] = gatheredNamesSize;
+		gatheredNamesSize += (0 == rank) ? counts[r] : 0;
+	}
+
+	std::vector<char> gatheredNames(std::max(gatheredNamesSize, 1));
+	MPI_Gatherv(names.empty() ? NULL : &names[0], namesSize, MPI_CHAR,
+		&gatheredNames[0], &counts[0], &displs[0], MPI_CHAR, 0, MPI_COMM_WORLD);
+
+	// statistics and dense histograms, in the order of globalHashes
+	const double scale = secondsPerTick * 1.0e9;
+	const size_t globalCount = globalHashes.size();
+
+	std::vector<KernelRankStats> stats(std::max(globalCount, (size_t) 1));
+	memset(&stats[0], 0, stats.size() * sizeof(KernelRankStats));
+
+	std::vector<uint64_t> histograms(std::max(globalCount * HISTOGRAM_BUCKETS, (size_t) 1), 0);
+
+	for(size_t i = 0, g = 0; i < local.size(); i++) {
+		while(globalHashes[g] != local[i].first) g++;
+
+		const KernelPerformanceInfo* info = local[i].second;
+		KernelRankStats& entry = stats[g];
+
+		entry.callCount = info->getCallCount();
+		entry.time = info->getTime() * scale;
+		entry.m2 = info->getM2() * scale * scale;
+		entry.minTime = info->getMinTime() * scale;
+		entry.maxTime = info->getMaxTime() * scale;
+		entry.selfTime = info->getSelfTime() * scale;
+		entry.bytes = info->getBytes();
+		entry.ranks = 1;
+		entry.rankMinTime = entry.time;
+		entry.rankMaxTime = entry.time;
+		entry.rankMaxRank = rank;
+		entry.histogramMax = info->getHistogram().maxValue;
+		entry.timedCount = info->getTimedCount();
+		entry.timeVariance = info->getTimeVariance() * scale * scale;
+		entry.overhead = info->getOverhead() * scale;
+
+		memcpy(&histograms[g * HISTOGRAM_BUCKETS], info->getHistogram().counts,
+			HISTOGRAM_BUCKETS * sizeof(uint64_t));
+	}
+
+	MPI_Datatype statsType;
+	MPI_Type_contiguous((int) sizeof(KernelRankStats), MPI_BYTE, &statsType);
+	MPI_Type_commit(&statsType);
+
+	MPI_Op statsOp;
+	MPI_Op_create(reduce_kernel_rank_stats, 1, &statsOp);
+
+	std::vector<KernelRankStats> reduced((0 == rank) ? stats.size() : 1);
+	std::vector<uint64_t> reducedHistograms((0 == rank) ? histograms.size() : 1);
+	double totalNs = totalTicks * scale;
+	double reducedTotalNs = 0;
+
+	MPI_Reduce(&stats[0], &reduced[0], (int) globalCount, statsType, statsOp, 0, MPI_COMM_WORLD);
+	MPI_Reduce(&histograms[0], &reducedHistograms[0], (int) (globalCount * HISTOGRAM_BUCKETS),
+		MPI_UINT64_T, MPI_SUM, 0, MPI_COMM_WORLD);
+	MPI_Reduce(&totalNs, &reducedTotalNs, 1, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
+
+	MPI_Op_free(&statsOp);
+	MPI_Type_free(&statsType);
+
+	// launch gaps are few next to the kernels, rank 0 merges them itself
+	std::unordered_map<const KernelPerformanceInfo*, uint64_t> localHashOf;
+	for(size_t i = 0; i < local.size(); i++) {
+		localHashOf[local[i].second] = local[i].first;
+	}
+
+	std::vector<KernelRankGap> gaps;
+	for(auto gap_itr = gap_map.begin(); gap_itr != gap_map.end(); gap_itr++) {
+		KernelRankGap gap;
+		gap.prevHash = localHashOf[gap_itr->first.first];
+		gap.nextHash = localHashOf[gap_itr->first.second];
+		gap.count = gap_itr->second.count;
+		gap.time = gap_itr->second.time * scale;
+		gap.maxTime = gap_itr->second.maxTime * scale;
+		gaps.push_back(gap);
+	}
+
+	const int gapsSize = (int) (gaps.size() * sizeof(KernelRankGap));
+	MPI_Gather(&gapsSize, 1, MPI_INT, &counts[0], 1, MPI_INT, 0, MPI_COMM_WORLD);
+
+	int gatheredGapsSize = 0;
+	for(int r = 0; r < size; r++) {
+		displs[r] = gatheredGapsSize;
+		gatheredGapsSize += (0 == rank) ? counts[r] : 0;
+	}
+
+	std::vector<KernelRankGap> gatheredGaps(std::max(gatheredGapsSize / sizeof(KernelRankGap),
+		(size_t) 1));
+	MPI_Gatherv(gaps.empty() ? NULL : &gaps[0], gapsSize, MPI_BYTE,
+		&gatheredGaps[0], &counts[0], &displs[0], MPI_BYTE, 0, MPI_COMM_WORLD);
+
+	std::vector<KernelRankChain> chains;
+	for(auto chain_itr = chain_map.begin(); chain_itr != chain_map.end(); chain_itr++) {
+		KernelRankChain chain;
+		memset(&chain, 0, sizeof(chain));
+
+		while(chain.length < KERNEL_CHAIN_MAX && NULL != chain_itr->first.kernels[chain.length]) {
+			chain.hashes[chain.length] = localHashOf[chain_itr->first.kernels[chain.length]];
+			chain.length++;
+		}
+
+		chain.count = chain_itr->second.count;
+		chain.time = chain_itr->second.time * scale;
+		chains.push_back(chain);
+	}
+
+	const int chainsSize = (int) (chains.size() * sizeof(KernelRankChain));
+	MPI_Gather(&chainsSize, 1, MPI_INT, &counts[0], 1, MPI_INT, 0, MPI_COMM_WORLD);
+
+	int gatheredChainsSize = 0;
+	for(int r = 0; r < size; r++) {
+		displs[r] = gatheredChainsSize;
+		gatheredChainsSize += (0 == rank) ? counts[r] : 0;
+	}
+
+	std::vector<KernelRankChain> gatheredChains(std::max(gatheredChainsSize / sizeof(KernelRankChain),
+		(size_t) 1));
+	MPI_Gatherv(chains.empty() ? NULL : &chains[0], chainsSize, MPI_BYTE,
+		&gatheredChains[0], &counts[0], &displs[0], MPI_BYTE, 0, MPI_COMM_WORLD);
+
+	arena.close();
+
+	if(0 != rank) {
+		unlink(fileOutput);
+		return true;
+	}
+
+	struct KernelName {
+		KernelExecutionType kType;
+		const char* name;
+		const char* path;
+	};
+
+	std::unordered_map<uint64_t, KernelName> remoteNames;
+
+	for(int offset = 0; offset < gatheredNamesSize; ) {
+		uint64_t hash = 0;
+		uint32_t kType = 0;
+		memcpy(&hash, &gatheredNames[offset], sizeof(hash));
+		memcpy(&kType, &gatheredNames[offset + sizeof(hash)], sizeof(kType));
+
+		KernelName& entry = remoteNames[hash];
+		entry.kType = (KernelExecutionType) kType;
+		entry.name = &gatheredNames[offset + sizeof(hash) + sizeof(kType)];
+		entry.path = entry.name + strlen(entry.name) + 1;
+
+		offset = (int) (entry.path + strlen(entry.path) + 1 - &gatheredNames[0]);
+	}
+
+	KernelFileWriter writer;
+
+	for(size_t g = 0, i = 0; g < globalCount; g++) {
+		const KernelRankStats& entry = reduced[g];
+		KernelPerformanceInfo* merged = NULL;
+
+		if(i < local.size() && local[i].first == globalHashes[g]) {
+			const KernelPerformanceInfo* info = local[i++].second;
+
+			merged = new KernelPerformanceInfo(info->getName(), info->getKernelType());
+			merged->setRegionPath(info->getRegionPath(), info->getRegionPathHash());
+		} else {
+			const KernelName& name = remoteNames[globalHashes[g]];
+
+			merged = new KernelPerformanceInfo(name.name, name.kType);
+			merged->setRegionPath(name.path, 0);
+		}
+
+		merged->mergeStats(entry.callCount, entry.time, entry.m2, entry.minTime, entry.maxTime);
+		merged->addSelfTime(entry.selfTime);
+		merged->addBytes(entry.bytes);
+		merged->addRankStats(entry.ranks, entry.time, entry.rankM2, entry.rankMinTime,
+			entry.rankMaxTime);
+		merged->setRankMaxRank(entry.rankMaxRank);
+		merged->addSampling(entry.timedCount, entry.timeVariance);
+		merged->addOverhead(entry.overhead);
+
+		KernelTimeHistogram& histogram = merged->getHistogram();
+		memcpy(histogram.counts, &reducedHistograms[g * HISTOGRAM_BUCKETS],
+			HISTOGRAM_BUCKETS * sizeof(uint64_t));
+		histogram.maxValue = entry.histogramMax;
+
+		writer.addKernel(*merged);
+		delete merged;
+	}
+
+	// records were added in the order of globalHashes
+	std::map<std::pair<uint32_t, uint32_t>, LaunchGap> mergedGaps;
+
+	for(size_t i = 0; i < gatheredGapsSize / sizeof(KernelRankGap); i++) {
+		const KernelRankGap& gap = gatheredGaps[i];
+		const uint32_t prev = (uint32_t) (std::lower_bound(globalHashes.begin(),
+			globalHashes.end(), gap.prevHash) - globalHashes.begin());
+		const uint32_t next = (uint32_t) (std::lower_bound(globalHashes.begin(),
+			globalHashes.end(), gap.nextHash) - globalHashes.begin());
+
+		LaunchGap& merged = mergedGaps[std::make_pair(prev, next)];
+		merged.count += gap.count;
+		merged.time += gap.time;
+		merged.maxTime = fmax(merged.maxTime, gap.maxTime);
+	}
+
+	for(auto gap_itr = mergedGaps.begin(); gap_itr != mergedGaps.end(); gap_itr++) {
+		writer.addLaunchGap(gap_itr->first.first, gap_itr->first.second, gap_itr->second.count,
+			gap_itr->second.time, gap_itr->second.maxTime);
+	}
+
+	std::map<std::vector<uint32_t>, KernelChain> mergedChains;
+
+	for(size_t i = 0; i < gatheredChainsSize / sizeof(KernelRankChain); i++) {
+		const KernelRankChain& chain = gatheredChains[i];
+		std::vector<uint32_t> chainRecords;
+
+		for(uint64_t k = 0; k < chain.length; k++) {
+			chainRecords.push_back((uint32_t) (std::lower_bound(globalHashes.begin(),
+				globalHashes.end(), chain.hashes[k]) - globalHashes.begin()));
+		}
+
+		KernelChain& merged = mergedChains[chainRecords];
+		merged.count += chain.count;
+		merged.time += chain.time;
+	}
+
+	for(auto chain_itr = mergedChains.begin(); chain_itr != mergedChains.end(); chain_itr++) {
+		writer.addKernelChain((uint32_t) chain_itr->first.size(), &chain_itr->first[0],
+			chain_itr->second.count, chain_itr->second.time);
+	}
+
+	const std::string mergedOutput = std::string(fileOutput) + ".tmp";
+
+	if(! writer.write(mergedOutput.c_str(), (uint64_t) reducedTotalNs, 1.0e-9) ||
+		0 != rename(mergedOutput.c_str(), fileOutput)) {
+		fprintf(stderr, "KokkosP: Error: unable to write kernel timing to %s\n", fileOutput);
+		unlink(mergedOutput.c_str());
+		return true;
+	}
+
+	char currentwd[256];
+	getcwd(currentwd, 256);
+	printf("KokkosP: Kernel timing of %d ranks written to %s/%s \n", size, currentwd, fileOutput);
+
+	return true;
+}
+#endif // USE_MPI
+
 extern "C" void kokkosp_finalize_library() {
-	double finishTime = seconds();
+	uint64_t finishTime = ticks();
 	double kernelTimes = 0;
 
-	char* hostname = (char*) malloc(sizeof(char) * 256);
-	gethostname(hostname, 256);
-
 	char* fileOutput = (char*) malloc(sizeof(char) * 256);
-	sprintf(fileOutput, "%s-%d.dat", hostname, (int) getpid());
+	output_file_name(fileOutput, 256, "dat");
 
-	free(hostname);
-	FILE* output_data = fopen(fileOutput, "wb");
+	// merged on kernel name and region path
+	std::map<std::pair<std::string, std::string>, KernelPerformanceInfo*> count_map;
+	std::unordered_map<KernelArenaRecord*, KernelPerformanceInfo*> merged_records;
+	std::unordered_map<std::pair<KernelPerformanceInfo*, KernelPerformanceInfo*>, LaunchGap,
+		LaunchGapKeyHash> gap_map;
+	std::unordered_map<KernelChainKey<KernelPerformanceInfo>, KernelChain, KernelChainKeyHash> chain_map;
 
-	const double totalExecuteTime = (finishTime - initTime);
-	fwrite(&totalExecuteTime, sizeof(totalExecuteTime), 1, output_data);
+	{
+		std::lock_guard<std::mutex> lock(shard_lock);
 
-	std::vector<KernelPerformanceInfo*> kernelList;
+		for(auto shard_itr = shards.begin(); shard_itr != shards.end(); shard_itr++) {
+			if(0 != snapshot_interval) {
+				write_snapshot(*shard_itr, finishTime);
+			}
+
+			std::vector<KernelArenaRecord*>& shard_kernels = (*shard_itr)->kernels;
+
+			for(auto kernel_itr = shard_kernels.begin(); kernel_itr != shard_kernels.end(); kernel_itr++) {
+				const std::pair<std::string, std::string> kernelKey((*kernel_itr)->getName(),
+					(*kernel_itr)->getRegionPath());
+				auto merged_itr = count_map.find(kernelKey);
+
+				if(merged_itr == count_map.end()) {
+					KernelPerformanceInfo* merged = new KernelPerformanceInfo(kernelKey.first,
+						(*kernel_itr)->getKernelType());
+					merged->setRegionPath(kernelKey.second, (*kernel_itr)->getRegionPathHash());
+					merged_itr = count_map.insert(std::make_pair(kernelKey, merged)).first;
+				}
+
+				(*kernel_itr)->updateEstimate();
+				mergeKernelFileRecord((*kernel_itr)->getRecord(), (*kernel_itr)->getBuckets(),
+					1.0, sizeof(KernelFileRecord), *merged_itr->second);
+				merged_records[*kernel_itr] = merged_itr->second;
+			}
+
+			for(auto gap_itr = (*shard_itr)->launchGaps.begin();
+				gap_itr != (*shard_itr)->launchGaps.end(); gap_itr++) {
+
+				LaunchGap& merged = gap_map[std::make_pair(merged_records[gap_itr->first.first],
+					merged_records[gap_itr->first.second])];
+				merged.count += gap_itr->second.count;
+				merged.time += gap_itr->second.time;
+				merged.maxTime = fmax(merged.maxTime, gap_itr->second.maxTime);
+			}
+
+			for(auto chain_itr = (*shard_itr)->chains.begin();
+				chain_itr != (*shard_itr)->chains.end(); chain_itr++) {
+
+				KernelChainKey<KernelPerformanceInfo> key;
+				for(int i = 0; i < KERNEL_CHAIN_MAX; i++) {
+					key.kernels[i] = (NULL == chain_itr->first.kernels[i]) ? NULL :
+						merged_records[chain_itr->first.kernels[i]];
+				}
+
+				KernelChain& merged = chain_map[key];
+				merged.count += chain_itr->second.count;
+				merged.time += chain_itr->second.time;
+			}
+		}
+	}
+
+	snapshot_writer.close();
+
+#if USE_MPI
+	if(write_merged_file(count_map, gap_map, chain_map, finishTime - initTime, fileOutput)) {
+		free(fileOutput);
+		return;
+	}
+#endif
+
+	KernelFileWriter writer;
+	std::unordered_map<KernelPerformanceInfo*, uint32_t> record_indices;
 
 	for(auto kernel_itr = count_map.begin(); kernel_itr != count_map.end(); kernel_itr++) {
-		kernel_itr->second->writeToFile(output_data);
+		record_indices[kernel_itr->second] = writer.addKernel(*kernel_itr->second);
+	}
+
+	for(auto gap_itr = gap_map.begin(); gap_itr != gap_map.end(); gap_itr++) {
+		writer.addLaunchGap(record_indices[gap_itr->first.first], record_indices[gap_itr->first.second],
+			gap_itr->second.count, gap_itr->second.time, gap_itr->second.maxTime);
 	}
 
-	fclose(output_data);
+	for(auto chain_itr = chain_map.begin(); chain_itr != chain_map.end(); chain_itr++) {
+		uint32_t chainRecords[KERNEL_CHAIN_MAX];
+		uint32_t length = 0;
+
+		while(length < KERNEL_CHAIN_MAX && NULL != chain_itr->first.kernels[length]) {
+			chainRecords[length] = record_indices[chain_itr->first.kernels[length]];
+			length++;
+		}
+
+		writer.addKernelChain(length, chainRecords, chain_itr->second.count, chain_itr->second.time);
+	}
+
+	// The compact file replaces the arena in one step, so the arena stays
+	// intact if the job dies while it is written.
+	const std::string compactOutput = std::string(fileOutput) + ".tmp";
+	arena.setTotalTicks(finishTime - initTime);
+
+	if(! writer.write(compactOutput.c_str(), finishTime - initTime) ||
+		0 != rename(compactOutput.c_str(), fileOutput)) {
+		fprintf(stderr, "KokkosP: Error: unable to write kernel timing to %s\n", fileOutput);
+		unlink(compactOutput.c_str());
+		arena.close();
+		free(fileOutput);
+		return;
+	}
+
+	arena.close();
 
 	char currentwd[256];
   getcwd(currentwd, 256);
@@ -266,48 +1489,114 @@ extern "C" void kokkosp_finalize_library() {
 }
 
 extern "C" void kokkosp_begin_parallel_for(const char* name, const uint32_t devID, uint64_t* kID) {
-	*kID = uniqID++;
-
 	if( (NULL == name) || (strcmp("", name) == 0) ) {
 		fprintf(stderr, "Error: kernel is empty\n");
 		exit(-1);
 	}
 
-	increment_counter(name, PARALLEL_FOR);
+	begin_kernel(kID, increment_counter(name, PARALLEL_FOR));
 }
 
 extern "C" void kokkosp_end_parallel_for(const uint64_t kID) {
-	currentEntry->addFromTimer();
+	stop_kernel_timer(kID);
 }
 
 extern "C" void kokkosp_begin_parallel_scan(const char* name, const uint32_t devID, uint64_t* kID) {
-	*kID = uniqID++;
-
 	if( (NULL == name) || (strcmp("", name) == 0) ) {
 		fprintf(stderr, "Error: kernel is empty\n");
 		exit(-1);
 	}
 
-	increment_counter(name, PARALLEL_SCAN);
+	begin_kernel(kID, increment_counter(name, PARALLEL_SCAN));
 }
 
 extern "C" void kokkosp_end_parallel_scan(const uint64_t kID) {
-	currentEntry->addFromTimer();
+	stop_kernel_timer(kID);
 }
 
 extern "C" void kokkosp_begin_parallel_reduce(const char* name, const uint32_t devID, uint64_t* kID) {
-	*kID = uniqID++;
-
 	if( (NULL == name) || (strcmp("", name) == 0) ) {
 		fprintf(stderr, "Error: kernel is empty\n");
 		exit(-1);
 	}
 
-	increment_counter(name, PARALLEL_REDUCE);
+	begin_kernel(kID, increment_counter(name, PARALLEL_REDUCE));
 }
 
 extern "C" void kokkosp_end_parallel_reduce(const uint64_t kID) {
-	currentEntry->addFromTimer();
+	stop_kernel_timer(kID);
+}
+
+extern "C" void kokkosp_begin_fence(const char* name, const uint32_t devID, uint64_t* handle) {
+	*handle = uniqID++;
+
+	// Kokkos::deep_copy fences inside its own begin/end callbacks; that time
+	// is already the copy's, so such a fence is left untimed
+	if(! get_local_shard()->deepCopies.empty()) {
+		*handle |= KERNEL_UNTIMED_ID;
+		return;
+	}
+
+	start_kernel_timer(*handle, increment_counter(
+		((NULL == name) || (strcmp("", name) == 0)) ? "Unnamed fence" : name, FENCE));
+}
+
+extern "C" void kokkosp_end_fence(const uint64_t handle) {
+	stop_kernel_timer(handle);
+}
+
+struct SpaceHandle {
+	char name[64];
+};
+
+extern "C" void kokkosp_begin_deep_copy(SpaceHandle dst_handle, const char* dst_name, const void* /*dst_ptr*/,
+	SpaceHandle src_handle, const char* src_name, const void* /*src_ptr*/,
+	uint64_t size) {
+
+	KernelStatsShard* shard = get_local_shard();
+
+	// keyed on the label of the destination and the pair of memory spaces
+	const char* label = ((NULL != dst_name) && (0 != dst_name[0])) ? dst_name :
+		(((NULL != src_name) && (0 != src_name[0])) ? src_name : "Unlabeled");
+
+	shard->deepCopyName.assign(label);
+	shard->deepCopyName.append(" (");
+	shard->deepCopyName.append(src_handle.name, strnlen(src_handle.name, sizeof(src_handle.name)));
+	shard->deepCopyName.append(" -> ");
+	shard->deepCopyName.append(dst_handle.name, strnlen(dst_handle.name, sizeof(dst_handle.name)));
+	shard->deepCopyName.append(")");
+
+	DeepCopyFrame frame;
+	frame.info = increment_counter(shard->deepCopyName.c_str(), DEEP_COPY);
+	frame.startTime = ticks();
+	frame.bytes = size;
+
+	begin_region_child(shard, frame.startTime);
+	begin_launch_gap_child(shard, frame.info, frame.startTime);
+	shard->chainLength = 0;
+	shard->deepCopies.push_back(frame);
+}
+
+extern "C" void kokkosp_end_deep_copy() {
+	const uint64_t endTime = ticks();
+	KernelStatsShard* shard = get_local_shard();
+
+	if(shard->deepCopies.empty()) {
+		fprintf(stderr, "KokkosP: Warning: end of a deep copy which was never started\n");
+		return;
+	}
+
+	const DeepCopyFrame frame = shard->deepCopies.back();
+	shard->deepCopies.pop_back();
+
+	end_region_child(shard, endTime, kernel_overhead, kernel_outside);
+
+	frame.info->addTime((double) (endTime - frame.startTime));
+	frame.info->addBytes(frame.bytes);
+	frame.info->addOverhead(kernel_overhead);
+	end_launch_gap_child(shard, frame.info, endTime);
+
+	check_periodic(shard, frame.info, endTime);
 }
 
 extern "C" void kokkosp_push_profile_region(char* regionName) {
@@ -315,31 +1604,47 @@ extern "C" void kokkosp_push_profile_region(char* regionName) {
 }
 
 extern "C" void kokkosp_pop_profile_region() {
-        current_region_level--;
-        
-        // current_region_level is out of bounds, inform the user they 
+        KernelStatsShard* shard = get_local_shard();
+
+        // the region stack is empty, inform the user they
         // called popRegion too many times.
-        if (current_region_level < 0) {
-           current_region_level = 0;
+        if (0 == shard->regionDepth) {
            std::cerr << "WARNING:: Kokkos::Profiling::popRegion() called outside " <<
                    " of an actve region. Previous regions: ";
 
-          /* This code block will walk back through the non-null regions 
-           * pointers and print the names.  This takes advantage of a slight
-           * issue with regions logic: we never actually delete the 
-           * KernelPerformanceInfo objects.  If that ever changes this needs
-           * to be updated. 
+          /* Popped frames are kept on the stack, so this walks the
+           * outermost regions this thread has seen most recently.
            */
-           for (int i = 0; i < 5; i++) {
-              if (regions[i] != 0 ) {
-                 std::cerr << (i == 0 ? " " : ";") << regions[i]->getName();
-              } else {
-                 break;
-              }
+           for (size_t i = 0; i < 5 && i < shard->regionStack.size(); i++) {
+              std::cerr << (i == 0 ? " " : ";") << shard->regionStack[i].info->getName();
            }
            std::cerr << "\n";
-        } else {
-           // don't call addFromTimer if we are outside an active region
-           regions[current_region_level]->addFromTimer();
+           return;
+        }
+
+        const uint64_t endTime = ticks();
+        RegionFrame& frame = shard->regionStack[--shard->regionDepth];
+        shard->chainLength = 0;
+
+        if (frame.activeChildren > 0) {
+           frame.childTime += endTime - frame.childStart;
+        }
+
+        // inclusive time, and the time not covered by child kernels or regions
+        const uint64_t regionTime = endTime - frame.startTime;
+        double time = (double) regionTime;
+        double selfTime = (regionTime > frame.childTime) ?
+           (double) (regionTime - frame.childTime) : 0.0;
+
+        if (subtract_overhead) {
+           time = fmax(time - frame.childOverhead, 0.0);
+           selfTime = fmax(selfTime - frame.selfOverhead, 0.0);
         }
+
+        frame.info->addTime(time);
+        frame.info->addSelfTime(selfTime);
+        frame.info->addOverhead(frame.childOverhead);
+
+        end_region_child(shard, endTime, region_overhead + frame.childOverhead, region_outside);
+        check_periodic(shard, frame.info, endTime);
 }
@@ -46,92 +46,1220 @@
 #include <vector>
 #include <algorithm>
 #include <map>
+#include <thread>
+#include <regex>
 
 #include "kp_kernel_info.h"
+#include "kp_kernel_file.h"
 
 bool compareKernelPerformanceInfo(KernelPerformanceInfo* left, KernelPerformanceInfo* right) {
 	return left->getTime() > right->getTime();
 };
 
-int find_index(std::vector<KernelPerformanceInfo*>& kernels,
-	const char* kernelName) {
+// Most time lost to the slowest rank first, then by time
+bool compareKernelImbalanceCost(KernelPerformanceInfo* left, KernelPerformanceInfo* right) {
+	if(left->getRankImbalanceCost() != right->getRankImbalanceCost()) {
+		return left->getRankImbalanceCost() > right->getRankImbalanceCost();
+	}
+
+	return left->getTime() > right->getTime();
+};
+
+// Bit of each kernel type named in a comma separated list of for, reduce,
+// scan, region, fence and copy; 0 for an unknown name
+uint32_t parse_type_mask(const char* types) {
+	const char* names[] = { "for", "reduce", "scan", "region", "fence", "copy" };
+	const KernelExecutionType kTypes[] = { PARALLEL_FOR, PARALLEL_REDUCE, PARALLEL_SCAN,
+		REGION, FENCE, DEEP_COPY };
+
+	uint32_t mask = 0;
+	const char* start = types;
+
+	while(true) {
+		const char* end = strchr(start, ',');
+		const size_t length = (NULL == end) ? strlen(start) : (size_t) (end - start);
+		uint32_t bit = 0;
+
+		for(int i = 0; i < 6; i++) {
+			if(strlen(names[i]) == length && 0 == strncmp(start, names[i], length)) {
+				bit = 1u << kTypes[i];
+			}
+		}
+
+		if(0 == bit) return 0;
+		mask |= bit;
+
+		if(NULL == end) break;
+		start = end + 1;
+	}
+
+	return mask;
+}
+
+// Regions followed by the other kernels of the types in typeMask whose
+// demangled name matches match (if given), each cut to the top (0 for all)
+// by compare. Only the rows kept are sorted, and only names of kernels of
+// the selected types are demangled.
+std::vector<KernelPerformanceInfo*> select_kernels(const std::vector<KernelPerformanceInfo*>& kernels,
+	const int top, const uint32_t typeMask, const std::regex* match, DemangleCache& demangled,
+	bool (*compare)(KernelPerformanceInfo*, KernelPerformanceInfo*)) {
+
+	std::vector<KernelPerformanceInfo*> regions;
+	std::vector<KernelPerformanceInfo*> others;
+
+	for(size_t i = 0; i < kernels.size(); i++) {
+		KernelPerformanceInfo* kernel = kernels[i];
+
+		if(0 == (typeMask & (1u << kernel->getKernelType()))) continue;
+		if(NULL != match && ! std::regex_search(demangled.get(kernel->getName()), *match)) continue;
+
+		((kernel->getKernelType() == REGION) ? regions : others).push_back(kernel);
+	}
+
+	std::vector<KernelPerformanceInfo*>* lists[] = { &regions, &others };
+	std::vector<KernelPerformanceInfo*> selected;
+
+	for(int l = 0; l < 2; l++) {
+		std::vector<KernelPerformanceInfo*>& list = *lists[l];
+		const size_t shown = (top > 0) ? std::min(list.size(), (size_t) top) : list.size();
+
+		std::partial_sort(list.begin(), list.begin() + shown, list.end(), compare);
+		selected.insert(selected.end(), list.begin(), list.begin() + shown);
+	}
+
+	return selected;
+}
+
+// Keeps the outermost depth regions of a ';' separated region path. A depth
+// of 0 drops the path, rolling kernels up by name; a negative depth keeps
+// the full path.
+std::string truncate_region_path(const char* regionPath, const int depth) {
+	if(depth < 0) return regionPath;
+
+	int level = 0;
+	const char* end = regionPath;
+
+	while(*end != '\0') {
+		if(*end == ';' && ++level == depth) break;
+		end++;
+	}
+
+	if(depth == 0) end = regionPath;
+
+	return std::string(regionPath, end - regionPath);
+}
+
+// Exclusive region time: total, per call and percentage of the run. Files
+// written before self time was recorded have none to show.
+void print_self_time(KernelPerformanceInfo* region, const char delimiter,
+	const int fixed_width, const double totalExecuteTime) {
+
+	const double selfTime = region->getSelfTime();
+	if(std::isnan(selfTime)) return;
+	const double callCountDouble = (double) region->getCallCount();
+
+	if(fixed_width)
+		printf("%11s%c%15.5f%c%12s%c%15.5f%c%7s%c%7.3f\n", " (Self)    ",
+			delimiter, selfTime, delimiter, "",
+			delimiter, selfTime / callCountDouble, delimiter, "",
+			delimiter, (selfTime / totalExecuteTime) * 100.0);
+	else
+		printf("%s%c%f%c%f%c%f\n", " (Self)    ",
+			delimiter, selfTime,
+			delimiter, selfTime / callCountDouble,
+			delimiter, (selfTime / totalExecuteTime) * 100.0);
+}
+
+const char* type_label(const KernelExecutionType kType) {
+	switch(kType) {
+	case PARALLEL_FOR:
+		return " (ParFor)  ";
+	case PARALLEL_REDUCE:
+		return " (ParRed)  ";
+	case PARALLEL_SCAN:
+		return " (ParScan) ";
+	case FENCE:
+		return " (Fence)   ";
+	case DEEP_COPY:
+		return " (DeepCopy)";
+	default:
+		return " (Region)  ";
+	}
+}
+
+// Bytes moved by a deep copy path and the bandwidth achieved over its calls
+void print_bandwidth(KernelPerformanceInfo* copy, const char delimiter,
+	const int fixed_width) {
+
+	const double bytes = (double) copy->getBytes();
+	const double bandwidth = (copy->getTime() > 0) ? bytes / copy->getTime() * 1.0e-9 : 0;
+
+	if(fixed_width)
+		printf("%11s%c%15" PRIu64 "%c%12s%c%15.5f%c%7s\n", " (Bytes)   ",
+			delimiter, copy->getBytes(), delimiter, "",
+			delimiter, bandwidth, delimiter, "GB/s");
+	else
+		printf("%s%c%" PRIu64 "%c%f%c%s\n", " (Bytes)   ",
+			delimiter, copy->getBytes(),
+			delimiter, bandwidth, delimiter, "GB/s");
+}
+
+// Ranks that ran a kernel, the total time of the least and most loaded of
+// them, and the most loaded over the average; then the mean and standard
+// deviation of the total time per rank, the time the most loaded rank
+// spends beyond the mean, and the file it was read from
+void print_rank_stats(KernelPerformanceInfo* kernel, const char delimiter,
+	const int fixed_width) {
+
+	if(kernel->getRankCount() < 2) return;
+
+	if(fixed_width) {
+		printf("%11s%c%15.5f%c%12" PRIu64 "%c%15.5f%c%7.3f\n", " (Ranks)   ",
+			delimiter, kernel->getRankMinTime(), delimiter, kernel->getRankCount(),
+			delimiter, kernel->getRankMaxTime(), delimiter, kernel->getRankImbalance());
+		printf("%s%c%15.9f%c%15.9f%c%15.9f\n", " (Rank mean/stddev/cost) ",
+			delimiter, kernel->getRankMeanTime(),
+			delimiter, kernel->getRankStdDev(),
+			delimiter, kernel->getRankImbalanceCost());
+	} else {
+		printf("%s%c%f%c%" PRIu64 "%c%f%c%f\n", " (Ranks)   ",
+			delimiter, kernel->getRankMinTime(), delimiter, kernel->getRankCount(),
+			delimiter, kernel->getRankMaxTime(), delimiter, kernel->getRankImbalance());
+		printf("%s%c%.9f%c%.9f%c%.9f\n", " (Rank mean/stddev/cost) ",
+			delimiter, kernel->getRankMeanTime(),
+			delimiter, kernel->getRankStdDev(),
+			delimiter, kernel->getRankImbalanceCost());
+	}
+
+	if(NULL != kernel->getRankMaxSource()) {
+		if(kernel->getRankMaxRank() >= 0)
+			printf(" (Slowest) %s, rank %" PRId64 "\n", kernel->getRankMaxSource(),
+				kernel->getRankMaxRank());
+		else
+			printf(" (Slowest) %s\n", kernel->getRankMaxSource());
+	}
+}
+
+// Invocations timed out of a sampled kernel's calls, and the 95% error
+// bound of its estimated total time
+void print_sampling(KernelPerformanceInfo* kernel, const char delimiter,
+	const int fixed_width) {
+
+	if(! kernel->isSampled()) return;
+
+	if(fixed_width)
+		printf("%11s%c%15.5f%c%12" PRIu64 "%c%15s%c%7.3f\n", " (Sampled) ",
+			delimiter, kernel->getTimeError(), delimiter, kernel->getTimedCount(),
+			delimiter, "", delimiter, (kernel->getTimeError() / kernel->getTime()) * 100.0);
+	else
+		printf("%s%c%f%c%" PRIu64 "%c%f\n", " (Sampled) ",
+			delimiter, kernel->getTimeError(), delimiter, kernel->getTimedCount(),
+			delimiter, (kernel->getTimeError() / kernel->getTime()) * 100.0);
+}
+
+// Estimated time the tool spent in the callbacks of a kernel, or in those
+// nested in a region: total, per call and as a percentage of its time
+void print_overhead(KernelPerformanceInfo* kernel, const char delimiter,
+	const int fixed_width) {
+
+	const double overhead = kernel->getOverhead();
+	const double callCountDouble = (double) kernel->getCallCount();
+
+	if(fixed_width)
+		printf("%11s%c%15.5f%c%12s%c%15.9f%c%7.3f\n", " (Overhead)",
+			delimiter, overhead, delimiter, "",
+			delimiter, overhead / callCountDouble,
+			delimiter, (overhead / kernel->getTime()) * 100.0);
+	else
+		printf("%s%c%f%c%.9f%c%f\n", " (Overhead)",
+			delimiter, overhead,
+			delimiter, overhead / callCountDouble,
+			delimiter, (overhead / kernel->getTime()) * 100.0);
+}
+
+void print_region_path(KernelPerformanceInfo* kernel) {
+	if(kernel->getRegionPath().empty()) return;
+
+	printf(" (Path)    %s\n", kernel->getRegionPath().c_str());
+}
+
+void print_percentiles(KernelPerformanceInfo* kernel, const char delimiter,
+	const int fixed_width) {
+
+	const KernelTimeHistogram& histogram = kernel->getHistogram();
+	if(0 == histogram.getTotalCount()) return;
+
+	if(fixed_width)
+		printf("%s%c%15.9f%c%15.9f%c%15.9f%c%15.9f\n", " (p50/90/99/max) ",
+			delimiter, histogram.getPercentile(0.50),
+			delimiter, histogram.getPercentile(0.90),
+			delimiter, histogram.getPercentile(0.99),
+			delimiter, histogram.getMax());
+	else
+		printf("%s%c%.9f%c%.9f%c%.9f%c%.9f\n", " (p50/90/99/max) ",
+			delimiter, histogram.getPercentile(0.50),
+			delimiter, histogram.getPercentile(0.90),
+			delimiter, histogram.getPercentile(0.99),
+			delimiter, histogram.getMax());
+}
+
+void print_stats(KernelPerformanceInfo* kernel, const char delimiter,
+	const int fixed_width) {
+
+	if(fixed_width)
+		printf("%s%c%15.9f%c%15.9f%c%15.9f\n", " (min/max/stddev) ",
+			delimiter, kernel->getMinTime(),
+			delimiter, kernel->getMaxTime(),
+			delimiter, kernel->getStdDev());
+	else
+		printf("%s%c%.9f%c%.9f%c%.9f\n", " (min/max/stddev) ",
+			delimiter, kernel->getMinTime(),
+			delimiter, kernel->getMaxTime(),
+			delimiter, kernel->getStdDev());
+}
+
+// Host time between the end of one kernel and the begin of the next,
+// merged over files
+struct KernelLaunchGap {
+	KernelPerformanceInfo* prev;
+	KernelPerformanceInfo* next;
+	uint64_t count;
+	double time;
+	double maxTime;
+};
+
+bool compareKernelLaunchGap(const KernelLaunchGap* left, const KernelLaunchGap* right) {
+	return left->time > right->time;
+}
+
+// The largest launch gaps: total, count, mean, max and percentage of the run
+void print_launch_gaps(std::vector<KernelLaunchGap*>& gaps, const int limit,
+	DemangleCache& demangled, const char delimiter, const int fixed_width, const double totalExecuteTime) {
+
+	const size_t shown = std::min(gaps.size(), (size_t) limit);
+	std::partial_sort(gaps.begin(), gaps.begin() + shown, gaps.end(), compareKernelLaunchGap);
+
+	for(size_t i = 0; i < shown; i++) {
+		const KernelLaunchGap* gap = gaps[i];
+		const double callCountDouble = (double) gap->count;
+
+		printf("- %s\n", demangled.get(gap->prev->getName()));
+		printf("  -> %s\n", demangled.get(gap->next->getName()));
+
+		if(fixed_width)
+			printf("%11s%c%15.5f%c%12" PRIu64 "%c%15.9f%c%15.9f%c%7.3f\n", " (Gap)     ",
+				delimiter, gap->time, delimiter, gap->count,
+				delimiter, gap->time / callCountDouble, delimiter, gap->maxTime,
+				delimiter, (gap->time / totalExecuteTime) * 100.0);
+		else
+			printf("%s%c%f%c%" PRIu64 "%c%.9f%c%.9f%c%f\n", " (Gap)     ",
+				delimiter, gap->time, delimiter, gap->count,
+				delimiter, gap->time / callCountDouble, delimiter, gap->maxTime,
+				delimiter, (gap->time / totalExecuteTime) * 100.0);
+
+		if(! gap->prev->getRegionPath().empty() || ! gap->next->getRegionPath().empty()) {
+			printf(" (Path)    %s -> %s\n", gap->prev->getRegionPath().c_str(),
+				gap->next->getRegionPath().c_str());
+		}
+	}
+}
+
+// A run of consecutive kernels inside one region, merged over files
+struct KernelChainInfo {
+	std::vector<KernelPerformanceInfo*> kernels;
+	uint64_t count;
+	double time;
+};
+
+bool compareKernelChainInfo(const KernelChainInfo* left, const KernelChainInfo* right) {
+	return (left->count != right->count) ? (left->count > right->count) : (left->time > right->time);
+}
+
+// Whether every kernel of the chain takes under threshold seconds per call
+bool is_fusion_candidate(const KernelChainInfo* chain, const double threshold) {
+	for(size_t k = 0; k < chain->kernels.size(); k++) {
+		const KernelPerformanceInfo* kernel = chain->kernels[k];
+		if(kernel->getTime() >= threshold * (double) kernel->getCallCount()) return false;
+	}
+
+	return true;
+}
+
+// The most frequent of the chains of short kernels (see is_fusion_candidate):
+// total time of their kernels, count, time per occurrence and percentage
+// of the run
+void print_fusion_candidates(std::vector<KernelChainInfo*>& candidates, const int limit,
+	DemangleCache& demangled, const char delimiter, const int fixed_width,
+	const double totalExecuteTime) {
+
+	const size_t shown = std::min(candidates.size(), (size_t) limit);
+	std::partial_sort(candidates.begin(), candidates.begin() + shown, candidates.end(),
+		compareKernelChainInfo);
+
+	for(size_t i = 0; i < shown; i++) {
+		const KernelChainInfo* chain = candidates[i];
+		const double callCountDouble = (double) chain->count;
+
+		printf("- %s\n", demangled.get(chain->kernels[0]->getName()));
+		for(size_t k = 1; k < chain->kernels.size(); k++) {
+			printf("  -> %s\n", demangled.get(chain->kernels[k]->getName()));
+		}
+
+		if(fixed_width)
+			printf("%11s%c%15.5f%c%12" PRIu64 "%c%15.9f%c%7.3f\n", " (Chain)   ",
+				delimiter, chain->time, delimiter, chain->count,
+				delimiter, chain->time / callCountDouble,
+				delimiter, (chain->time / totalExecuteTime) * 100.0);
+		else
+			printf("%s%c%f%c%" PRIu64 "%c%.9f%c%f\n", " (Chain)   ",
+				delimiter, chain->time, delimiter, chain->count,
+				delimiter, chain->time / callCountDouble,
+				delimiter, (chain->time / totalExecuteTime) * 100.0);
+
+		print_region_path(chain->kernels[0]);
+	}
+}
+
+// Kernels, launch gaps and kernel chains of a set of files
+struct KernelAggregate {
+	KernelMergeTable merged;
+	std::map<std::pair<KernelPerformanceInfo*, KernelPerformanceInfo*>, KernelLaunchGap*> gap_map;
+	std::map<std::vector<KernelPerformanceInfo*>, KernelChainInfo*> chain_map;
+	double totalExecuteTime;
+	double totalLaunchGapTime;
+	uint64_t fileCount;       // files read, not those skipped
+
+	KernelAggregate() : totalExecuteTime(0), totalLaunchGapTime(0), fileCount(0) {}
+
+	~KernelAggregate() {
+		for(auto gap_itr = gap_map.begin(); gap_itr != gap_map.end(); gap_itr++) {
+			delete gap_itr->second;
+		}
+
+		for(auto chain_itr = chain_map.begin(); chain_itr != chain_map.end(); chain_itr++) {
+			delete chain_itr->second;
+		}
+	}
+
+	void addLaunchGap(KernelPerformanceInfo* prev, KernelPerformanceInfo* next,
+		const uint64_t count, const double time, const double maxTime) {
+
+		KernelLaunchGap*& gap = gap_map[std::make_pair(prev, next)];
+
+		if(NULL == gap) {
+			gap = new KernelLaunchGap();
+			gap->prev = prev;
+			gap->next = next;
+		}
+
+		gap->count += count;
+		gap->time += time;
+		gap->maxTime = std::max(gap->maxTime, maxTime);
+		totalLaunchGapTime += time;
+	}
+
+	void addKernelChain(const std::vector<KernelPerformanceInfo*>& kernels,
+		const uint64_t count, const double time) {
+
+		KernelChainInfo*& chain = chain_map[kernels];
+
+		if(NULL == chain) {
+			chain = new KernelChainInfo();
+			chain->kernels = kernels;
+		}
+
+		chain->count += count;
+		chain->time += time;
+	}
+
+	void addFile(const char* fileName, const int region_depth) {
+		KernelFileReader the_file;
+
+		if(! the_file.open(fileName)) {
+			fprintf(stderr, "Unable to read %s, skipping it\n", fileName);
+			return;
+		}
+
+		totalExecuteTime += the_file.getTotalExecuteTime();
+		fileCount++;
+
+		// merged kernel of each record in this file
+		std::vector<KernelPerformanceInfo*> file_kernels(the_file.getRecordCount(),
+			(KernelPerformanceInfo*) NULL);
+		KernelFileRankSamples file_ranks;
+
+		for(uint64_t r = 0; r < the_file.getRecordCount(); r++) {
+			const char* kernelName = the_file.getName(r);
+			if(strlen(kernelName) == 0) continue;
+
+			const std::string regionPath = truncate_region_path(the_file.getRegionPath(r), region_depth);
+			KernelPerformanceInfo* kernel = merged.get(kernelName, regionPath, the_file.getKernelType(r));
+
+			the_file.mergeInto(r, *kernel);
+			file_ranks.add(kernel, the_file.getRankSample(r));
+			file_kernels[r] = kernel;
+		}
+
+		file_ranks.mergeInto(fileName);
+
+		for(uint64_t g = 0; g < the_file.getLaunchGapCount(); g++) {
+			const KernelFileLaunchGap fileGap = the_file.getLaunchGap(g);
+			KernelPerformanceInfo* prev = file_kernels[fileGap.prevRecord];
+			KernelPerformanceInfo* next = file_kernels[fileGap.nextRecord];
+			if(NULL == prev || NULL == next) continue;
+
+			addLaunchGap(prev, next, fileGap.count, fileGap.time, fileGap.maxTime);
+		}
+
+		for(uint64_t c = 0; c < the_file.getKernelChainCount(); c++) {
+			const KernelFileKernelChain fileChain = the_file.getKernelChain(c);
+			std::vector<KernelPerformanceInfo*> kernels;
+
+			for(uint32_t k = 0; k < fileChain.length; k++) {
+				if(NULL != file_kernels[fileChain.records[k]]) {
+					kernels.push_back(file_kernels[fileChain.records[k]]);
+				}
+			}
+
+			if(kernels.size() != fileChain.length) continue;
+
+			addKernelChain(kernels, fileChain.count, fileChain.time);
+		}
+	}
+
+	// Adds the files of other, which was filled from files after ours
+	void merge(const KernelAggregate& other) {
+		std::map<const KernelPerformanceInfo*, KernelPerformanceInfo*> into;
+		const std::vector<KernelPerformanceInfo*>& kernels = other.merged.getKernels();
+
+		for(size_t i = 0; i < kernels.size(); i++) {
+			KernelPerformanceInfo* kernel = merged.get(kernels[i]->getName(),
+				kernels[i]->getRegionPath(), kernels[i]->getKernelType());
+
+			kernel->merge(*kernels[i]);
+			into[kernels[i]] = kernel;
+		}
+
+		totalExecuteTime += other.totalExecuteTime;
+		fileCount += other.fileCount;
+
+		for(auto gap_itr = other.gap_map.begin(); gap_itr != other.gap_map.end(); gap_itr++) {
+			const KernelLaunchGap* gap = gap_itr->second;
+			addLaunchGap(into[gap->prev], into[gap->next], gap->count, gap->time, gap->maxTime);
+		}
+
+		for(auto chain_itr = other.chain_map.begin(); chain_itr != other.chain_map.end(); chain_itr++) {
+			std::vector<KernelPerformanceInfo*> chainKernels;
+
+			for(size_t k = 0; k < chain_itr->second->kernels.size(); k++) {
+				chainKernels.push_back(into[chain_itr->second->kernels[k]]);
+			}
+
+			addKernelChain(chainKernels, chain_itr->second->count, chain_itr->second->time);
+		}
+	}
+};
+
+// Reads count files on up to threads threads (0 for one per core). Each
+// thread reads a contiguous range of files, and the aggregates are merged
+// pairwise, so the result does not depend on thread timing.
+KernelAggregate* read_files(char* files[], const int count, int threads, const int region_depth) {
+	if(threads <= 0) {
+		threads = (int) std::thread::hardware_concurrency();
+	}
+
+	threads = std::max(1, std::min(threads, count));
+
+	std::vector<KernelAggregate*> aggregates;
+	std::vector<std::thread> workers;
+
+	for(int t = 0; t < threads; t++) {
+		aggregates.push_back(new KernelAggregate());
+	}
+
+	for(int t = 0; t < threads; t++) {
+		const int first = (int) ((int64_t) t * count / threads);
+		const int last = (int) ((int64_t) (t + 1) * count / threads);
+		KernelAggregate* aggregate = aggregates[t];
+
+		workers.push_back(std::thread([aggregate, files, first, last, region_depth]() {
+			for(int i = first; i < last; i++) {
+				aggregate->addFile(files[i], region_depth);
+			}
+		}));
+	}
+
+	for(size_t t = 0; t < workers.size(); t++) {
+		workers[t].join();
+	}
+
+	for(size_t stride = 1; stride < aggregates.size(); stride *= 2) {
+		std::vector<std::thread> mergers;
+
+		for(size_t t = 0; t + stride < aggregates.size(); t += 2 * stride) {
+			KernelAggregate* into = aggregates[t];
+			KernelAggregate* from = aggregates[t + stride];
+
+			mergers.push_back(std::thread([into, from]() {
+				into->merge(*from);
+			}));
+		}
+
+		for(size_t t = 0; t < mergers.size(); t++) {
+			mergers[t].join();
+		}
+	}
+
+	for(size_t t = 1; t < aggregates.size(); t++) {
+		delete aggregates[t];
+	}
+
+	return aggregates[0];
+}
+
+// Continued fraction of the regularized incomplete beta function, by the
+// modified Lentz method
+double incomplete_beta_fraction(const double a, const double b, const double x) {
+	const double tiny = 1.0e-300;
+	double c = 1.0;
+	double d = 1.0 - (a + b) * x / (a + 1.0);
+	d = 1.0 / ((fabs(d) < tiny) ? tiny : d);
+	double fraction = d;
+
+	for(int m = 1; m <= 300; m++) {
+		const double m2 = 2.0 * m;
+		double numerator = m * (b - m) * x / ((a + m2 - 1.0) * (a + m2));
+
+		d = 1.0 + numerator * d;
+		d = 1.0 / ((fabs(d) < tiny) ? tiny : d);
+		c = 1.0 + numerator / c;
+		c = (fabs(c) < tiny) ? tiny : c;
+		fraction *= d * c;
+
+		numerator = -(a + m) * (a + b + m) * x / ((a + m2) * (a + m2 + 1.0));
+
+		d = 1.0 + numerator * d;
+		d = 1.0 / ((fabs(d) < tiny) ? tiny : d);
+		c = 1.0 + numerator / c;
+		c = (fabs(c) < tiny) ? tiny : c;
+		const double step = d * c;
+		fraction *= step;
+
+		if(fabs(step - 1.0) < 1.0e-12) break;
+	}
+
+	return fraction;
+}
+
+double regularized_incomplete_beta(const double a, const double b, const double x) {
+	if(x <= 0) return 0;
+	if(x >= 1) return 1;
+
+	const double front = exp(lgamma(a + b) - lgamma(a) - lgamma(b) + a * log(x) + b * log(1.0 - x));
+
+	return (x < (a + 1.0) / (a + b + 2.0)) ? front * incomplete_beta_fraction(a, b, x) / a :
+		1.0 - front * incomplete_beta_fraction(b, a, 1.0 - x) / b;
+}
+
+// Probability of a t statistic at least this far from 0 under Student's t
+// distribution with df degrees of freedom
+double student_t_p_value(const double t, const double df) {
+	return regularized_incomplete_beta(df / 2.0, 0.5, df / (df + t * t));
+}
+
+// One side of a Welch test
+struct WelchSample {
+	double mean;
+	double variance;
+	double count;
+};
+
+// The total times of the ranks, or the times of the timed invocations
+WelchSample welch_sample(const KernelPerformanceInfo* kernel, const bool byRanks) {
+	WelchSample sample;
+
+	if(byRanks) {
+		sample.mean = kernel->getRankMeanTime();
+		sample.variance = kernel->getRankStdDev() * kernel->getRankStdDev();
+		sample.count = (double) kernel->getRankCount();
+	} else {
+		sample.mean = kernel->getTime() / (double) std::max((uint64_t) 1, kernel->getCallCount());
+		sample.variance = kernel->getVariance();
+		sample.count = (double) kernel->getTimedCount();
+	}
+
+	return sample;
+}
+
+// A kernel of either run, NULL for the run it is missing from
+struct KernelDiff {
+	KernelPerformanceInfo* base;
+	KernelPerformanceInfo* next;
+	double delta;        // total time of next over base
+	bool byRanks;        // tested over ranks rather than invocations
+	double t;
+	double df;
+	double p;            // NaN when not tested
+};
+
+bool compareKernelDiff(const KernelDiff& left, const KernelDiff& right) {
+	return fabs(left.delta) > fabs(right.delta);
+}
+
+// Welch's t-test of the difference between the runs. Kernels that ran in
+// every file of both runs, each file one rank and at least DIFF_MIN_RANKS
+// of them, are compared by their total time per rank. Others are compared
+// by their time per invocation, as a test over a handful of ranks has next
+// to no power, and files merged over MPI ranks or missing the kernel would
+// skew the rank samples.
+#define DIFF_MIN_RANKS 4
+
+void welch_test(KernelDiff& diff, const uint64_t baseFiles, const uint64_t nextFiles) {
+	diff.byRanks = false;
+	diff.t = 0;
+	diff.df = 0;
+	diff.p = std::numeric_limits<double>::quiet_NaN();
+
+	if(NULL == diff.base || NULL == diff.next) return;
+
+	diff.byRanks = diff.base->getRankCount() == baseFiles && baseFiles >= DIFF_MIN_RANKS &&
+		diff.next->getRankCount() == nextFiles && nextFiles >= DIFF_MIN_RANKS;
+
+	const WelchSample base = welch_sample(diff.base, diff.byRanks);
+	const WelchSample next = welch_sample(diff.next, diff.byRanks);
+
+	if(base.count < 2 || next.count < 2) return;
 
-	for(int i = 0; i < kernels.size(); i++) {
-		KernelPerformanceInfo* nextKernel = kernels[i];
+	const double baseError = base.variance / base.count;
+	const double nextError = next.variance / next.count;
+	const double error = baseError + nextError;
 
-		if(strcmp(nextKernel->getName(), kernelName) == 0) {
-			return i;
+	if(error <= 0) {
+		diff.p = (base.mean == next.mean) ? 1.0 : 0.0;
+		return;
+	}
+
+	diff.t = (next.mean - base.mean) / sqrt(error);
+	diff.df = error * error / (baseError * baseError / (base.count - 1) +
+		nextError * nextError / (next.count - 1));
+	diff.p = student_t_p_value(diff.t, diff.df);
+}
+
+double kernel_time(const KernelPerformanceInfo* kernel) {
+	return (NULL == kernel) ? 0 : kernel->getTime();
+}
+
+uint64_t kernel_calls(const KernelPerformanceInfo* kernel) {
+	return (NULL == kernel) ? 0 : kernel->getCallCount();
+}
+
+double kernel_time_per_call(const KernelPerformanceInfo* kernel) {
+	return (NULL == kernel || 0 == kernel->getCallCount()) ? 0 :
+		kernel->getTime() / (double) kernel->getCallCount();
+}
+
+// Time and calls of the selected kernels of two runs, largest change in
+// total time first, with the result of the Welch test at level alpha
+int print_diff(KernelAggregate& base, KernelAggregate& next, const int top,
+	const uint32_t typeMask, const std::regex* match, const double alpha,
+	const char delimiter, const int fixed_width) {
+
+	std::vector<KernelDiff> diffs;
+	const std::vector<KernelPerformanceInfo*>& baseKernels = base.merged.getKernels();
+	const std::vector<KernelPerformanceInfo*>& nextKernels = next.merged.getKernels();
+
+	for(size_t i = 0; i < baseKernels.size(); i++) {
+		KernelDiff diff;
+		diff.base = baseKernels[i];
+		diff.next = next.merged.find(diff.base->getName(), diff.base->getRegionPath());
+		diffs.push_back(diff);
+	}
+
+	for(size_t i = 0; i < nextKernels.size(); i++) {
+		if(NULL != base.merged.find(nextKernels[i]->getName(), nextKernels[i]->getRegionPath())) continue;
+
+		KernelDiff diff;
+		diff.base = NULL;
+		diff.next = nextKernels[i];
+		diffs.push_back(diff);
+	}
+
+	double baseKernelsTime = 0;
+	double nextKernelsTime = 0;
+	int slower = 0;
+	int faster = 0;
+	DemangleCache demangled;
+	std::vector<KernelDiff> selected;
+
+	for(size_t i = 0; i < diffs.size(); i++) {
+		KernelDiff& diff = diffs[i];
+		const KernelPerformanceInfo* kernel = (NULL != diff.base) ? diff.base : diff.next;
+
+		diff.delta = kernel_time(diff.next) - kernel_time(diff.base);
+
+		if(kernel->getKernelType() != REGION && kernel->getKernelType() != FENCE &&
+			kernel->getKernelType() != DEEP_COPY) {
+			baseKernelsTime += kernel_time(diff.base);
+			nextKernelsTime += kernel_time(diff.next);
 		}
+
+		if(0 == (typeMask & (1u << kernel->getKernelType()))) continue;
+		if(NULL != match && ! std::regex_search(demangled.get(kernel->getName()), *match)) continue;
+
+		welch_test(diff, base.fileCount, next.fileCount);
+
+		if(diff.p < alpha) {
+			((diff.t > 0) ? slower : faster)++;
+		}
+
+		selected.push_back(diff);
+	}
+
+	const size_t shown = (top > 0) ? std::min(selected.size(), (size_t) top) : selected.size();
+	std::partial_sort(selected.begin(), selected.begin() + shown, selected.end(), compareKernelDiff);
+
+	printf("Diff (new - base): \n\n");
+
+	for(size_t i = 0; i < shown; i++) {
+		const KernelDiff& diff = selected[i];
+		KernelPerformanceInfo* kernel = (NULL != diff.base) ? diff.base : diff.next;
+		const double baseTime = kernel_time(diff.base);
+		const double basePerCall = kernel_time_per_call(diff.base);
+		const double nextPerCall = kernel_time_per_call(diff.next);
+		const int64_t callDelta = (int64_t) kernel_calls(diff.next) - (int64_t) kernel_calls(diff.base);
+		const double perCallDelta = (basePerCall > 0) ? (nextPerCall / basePerCall - 1.0) * 100.0 : 0;
+
+		printf("- %s\n", demangled.get(kernel->getName()));
+
+		if(fixed_width) {
+			printf("%11s%c%15.5f%c%15.5f%c%15.5f%c%8.2f\n", type_label(kernel->getKernelType()),
+				delimiter, baseTime, delimiter, kernel_time(diff.next), delimiter, diff.delta,
+				delimiter, (baseTime > 0) ? diff.delta / baseTime * 100.0 : 0);
+			printf("%11s%c%15" PRIu64 "%c%15" PRIu64 "%c%15" PRId64 "\n", " (Calls)   ",
+				delimiter, kernel_calls(diff.base), delimiter, kernel_calls(diff.next),
+				delimiter, callDelta);
+			printf("%11s%c%15.9f%c%15.9f%c%15.9f%c%8.2f\n", " (Per call)",
+				delimiter, basePerCall, delimiter, nextPerCall,
+				delimiter, nextPerCall - basePerCall, delimiter, perCallDelta);
+		} else {
+			printf("%s%c%f%c%f%c%f%c%f\n", type_label(kernel->getKernelType()),
+				delimiter, baseTime, delimiter, kernel_time(diff.next), delimiter, diff.delta,
+				delimiter, (baseTime > 0) ? diff.delta / baseTime * 100.0 : 0);
+			printf("%s%c%" PRIu64 "%c%" PRIu64 "%c%" PRId64 "\n", " (Calls)   ",
+				delimiter, kernel_calls(diff.base), delimiter, kernel_calls(diff.next),
+				delimiter, callDelta);
+			printf("%s%c%.9f%c%.9f%c%.9f%c%f\n", " (Per call)",
+				delimiter, basePerCall, delimiter, nextPerCall,
+				delimiter, nextPerCall - basePerCall, delimiter, perCallDelta);
+		}
+
+		if(NULL == diff.base || NULL == diff.next) {
+			printf(" (Welch)    only in the %s run\n", (NULL == diff.base) ? "new" : "base");
+		} else if(std::isnan(diff.p)) {
+			printf(" (Welch)    too few samples\n");
+		} else {
+			const char* verdict = (diff.p >= alpha) ? "same" : ((diff.t > 0) ? "SLOWER" : "FASTER");
+
+			if(fixed_width)
+				printf("%11s%c%15.5f%c%15.2f%c%15.9f%c%8s%c%s\n", " (Welch)   ",
+					delimiter, diff.t, delimiter, diff.df, delimiter, diff.p,
+					delimiter, verdict, delimiter, diff.byRanks ? "ranks" : "calls");
+			else
+				printf("%s%c%f%c%f%c%.9f%c%s%c%s\n", " (Welch)   ",
+					delimiter, diff.t, delimiter, diff.df, delimiter, diff.p,
+					delimiter, verdict, delimiter, diff.byRanks ? "ranks" : "calls");
+		}
+
+		print_region_path(kernel);
+	}
+
+	printf("\n");
+	printf("-------------------------------------------------------------------------\n");
+	printf("Summary:\n");
+	printf("\n");
+	printf("Total Execution Time, base run:                        %20.5f seconds\n", base.totalExecuteTime);
+	printf("Total Execution Time, new run:                         %20.5f seconds\n", next.totalExecuteTime);
+	printf("Total Time in Kokkos kernels, base run:                %20.5f seconds\n", baseKernelsTime);
+	printf("Total Time in Kokkos kernels, new run:                 %20.5f seconds\n", nextKernelsTime);
+	printf("Selected kernels significantly slower (p < %5.3f):     %20d\n", alpha, slower);
+	printf("Selected kernels significantly faster (p < %5.3f):     %20d\n", alpha, faster);
+	printf("\n");
+	printf("-------------------------------------------------------------------------\n");
+
+	return 0;
+}
+
+// Writes the kernels as columns of one row per kernel, in the order given,
+// with demangled names; see KernelExportWriter for the layout
+int export_columns(const std::vector<KernelPerformanceInfo*>& kernels, DemangleCache& demangled,
+	const double totalExecuteTime, const char* path) {
+
+	const size_t rows = kernels.size();
+	KernelExportWriter writer(rows);
+
+	std::vector<uint32_t> names(rows), paths(rows), types(rows), rankMaxFiles(rows);
+	std::vector<uint64_t> calls(rows), bytes(rows), rankCounts(rows);
+	std::vector<double> times(rows), selfTimes(rows), minTimes(rows), maxTimes(rows),
+		variances(rows), overheads(rows), rankMinTimes(rows), rankMaxTimes(rows),
+		rankMeanTimes(rows), rankStdDevs(rows);
+
+	for(size_t i = 0; i < rows; i++) {
+		const KernelPerformanceInfo* kernel = kernels[i];
+		const char* rankMaxFile = kernel->getRankMaxSource();
+
+		names[i] = writer.internString(demangled.get(kernel->getName()));
+		paths[i] = writer.internString(kernel->getRegionPath().c_str());
+		types[i] = (uint32_t) kernel->getKernelType();
+		rankMaxFiles[i] = writer.internString((NULL != rankMaxFile) ? rankMaxFile : "");
+		calls[i] = kernel->getCallCount();
+		bytes[i] = kernel->getBytes();
+		rankCounts[i] = kernel->getRankCount();
+		times[i] = kernel->getTime();
+		selfTimes[i] = kernel->getSelfTime();
+		minTimes[i] = kernel->getMinTime();
+		maxTimes[i] = kernel->getMaxTime();
+		variances[i] = kernel->getVariance();
+		overheads[i] = kernel->getOverhead();
+		rankMinTimes[i] = kernel->getRankMinTime();
+		rankMaxTimes[i] = kernel->getRankMaxTime();
+		rankMeanTimes[i] = kernel->getRankMeanTime();
+		rankStdDevs[i] = kernel->getRankStdDev();
 	}
 
-	return -1;
+	writer.addColumn("name", KERNEL_EXPORT_STRING, names);
+	writer.addColumn("region_path", KERNEL_EXPORT_STRING, paths);
+	writer.addColumn("type", KERNEL_EXPORT_UINT32, types);
+	writer.addColumn("calls", KERNEL_EXPORT_UINT64, calls);
+	writer.addColumn("time", KERNEL_EXPORT_FLOAT64, times);
+	writer.addColumn("self_time", KERNEL_EXPORT_FLOAT64, selfTimes);
+	writer.addColumn("min_time", KERNEL_EXPORT_FLOAT64, minTimes);
+	writer.addColumn("max_time", KERNEL_EXPORT_FLOAT64, maxTimes);
+	writer.addColumn("variance", KERNEL_EXPORT_FLOAT64, variances);
+	writer.addColumn("bytes", KERNEL_EXPORT_UINT64, bytes);
+	writer.addColumn("overhead", KERNEL_EXPORT_FLOAT64, overheads);
+	writer.addColumn("rank_count", KERNEL_EXPORT_UINT64, rankCounts);
+	writer.addColumn("rank_min_time", KERNEL_EXPORT_FLOAT64, rankMinTimes);
+	writer.addColumn("rank_max_time", KERNEL_EXPORT_FLOAT64, rankMaxTimes);
+	writer.addColumn("rank_mean_time", KERNEL_EXPORT_FLOAT64, rankMeanTimes);
+	writer.addColumn("rank_stddev_time", KERNEL_EXPORT_FLOAT64, rankStdDevs);
+	writer.addColumn("rank_max_file", KERNEL_EXPORT_STRING, rankMaxFiles);
+
+	if(! writer.write(path, totalExecuteTime)) {
+		fprintf(stderr, "Unable to write %s\n", path);
+		return -1;
+	}
+
+	return 0;
+}
+
+// Calls and time of one kernel per snapshot interval, merged over files
+struct KernelTimeSeries {
+	std::string name;
+	std::string regionPath;
+	KernelExecutionType kType;
+	double time;
+	std::map<uint64_t, std::pair<uint64_t, double> > intervals;
+};
+
+bool compareKernelTimeSeries(const KernelTimeSeries* left, const KernelTimeSeries* right) {
+	return left->time > right->time;
+}
+
+int print_timeseries(int argc, char* argv[], const int first_file,
+	const char delimiter, const int fixed_width, const int region_depth) {
+
+	std::map<std::pair<std::string, std::string>, KernelTimeSeries*> series_map;
+	double interval = 0;
+
+	for(int i = first_file; i < argc; i++) {
+		KernelSnapshotReader the_file;
+
+		if(! the_file.open(argv[i])) {
+			fprintf(stderr, "Unable to read snapshots from %s, skipping it\n", argv[i]);
+			continue;
+		}
+
+		if(interval > 0 && interval != the_file.getInterval()) {
+			fprintf(stderr, "Warning: %s uses a snapshot interval of %f seconds, not %f\n",
+				argv[i], the_file.getInterval(), interval);
+		}
+
+		interval = (interval > 0) ? interval : the_file.getInterval();
+
+		const std::vector<KernelSnapshotReader::Name>& names = the_file.getNames();
+		const std::vector<KernelSnapshotReader::Delta>& deltas = the_file.getDeltas();
+
+		// series of each kernel id in this file
+		std::vector<KernelTimeSeries*> file_series(names.size(), (KernelTimeSeries*) NULL);
+
+		for(size_t d = 0; d < deltas.size(); d++) {
+			const KernelSnapshotReader::Delta& delta = deltas[d];
+			if(delta.id >= names.size() || names[delta.id].name.empty()) continue;
+
+			KernelTimeSeries*& series = file_series[delta.id];
+
+			if(NULL == series) {
+				const std::pair<std::string, std::string> key(names[delta.id].name,
+					truncate_region_path(names[delta.id].path.c_str(), region_depth));
+				auto series_itr = series_map.find(key);
+
+				if(series_itr == series_map.end()) {
+					KernelTimeSeries* created = new KernelTimeSeries();
+					created->name = key.first;
+					created->regionPath = key.second;
+					created->kType = names[delta.id].kType;
+					created->time = 0;
+					series_itr = series_map.insert(std::make_pair(key, created)).first;
+				}
+
+				series = series_itr->second;
+			}
+
+			std::pair<uint64_t, double>& bin = series->intervals[delta.interval];
+			bin.first += delta.callCount;
+			bin.second += delta.time;
+			series->time += delta.time;
+		}
+	}
+
+	std::vector<KernelTimeSeries*> kernelSeries;
+
+	for(auto series_itr = series_map.begin(); series_itr != series_map.end(); series_itr++) {
+		kernelSeries.push_back(series_itr->second);
+	}
+
+	std::sort(kernelSeries.begin(), kernelSeries.end(), compareKernelTimeSeries);
+	DemangleCache demangled;
+
+	printf("Time series (%f second intervals): \n\n", interval);
+
+	for(size_t i = 0; i < kernelSeries.size(); i++) {
+		KernelTimeSeries* series = kernelSeries[i];
+		printf("- %s%s\n", demangled.get(series->name.c_str()), (series->kType == REGION) ? " (Region)" : "");
+
+		if(! series->regionPath.empty()) {
+			printf(" (Path)    %s\n", series->regionPath.c_str());
+		}
+
+		for(auto bin_itr = series->intervals.begin(); bin_itr != series->intervals.end(); bin_itr++) {
+			const double start = bin_itr->first * interval;
+			const uint64_t calls = bin_itr->second.first;
+			const double time = bin_itr->second.second;
+
+			if(fixed_width)
+				printf("%11s%c%15.5f%c%12" PRIu64 "%c%15.5f%c%7.3f\n", "",
+					delimiter, start, delimiter, calls, delimiter, time,
+					delimiter, (time / interval) * 100.0);
+			else
+				printf("%s%c%f%c%" PRIu64 "%c%f%c%f\n", " ",
+					delimiter, start, delimiter, calls, delimiter, time,
+					delimiter, (time / interval) * 100.0);
+		}
+
+		delete series;
+	}
+
+	return 0;
 }
 
 int main(int argc, char* argv[]) {
 
 	if(argc == 1) {
 		fprintf(stderr, "Did you specify any data files on the command line!\n");
-		fprintf(stderr, "Usage: ./reader file1.dat [fileX.dat]*\n");
+		fprintf(stderr, "Usage: ./reader [--delimiter c] [--fixed-width n] [--percentiles] [--stats] [--overhead] [--launch-gaps n] [--fusion n] [--fusion-threshold us] [--threads n] [--top n] [--sort time|imbalance] [--type for,reduce,scan,region,fence,copy] [--match regex] [--region-paths] [--region-depth n] [--export out.kpc] file1.dat [fileX.dat]*\n");
+		fprintf(stderr, "       ./reader --diff [--alpha a] [--delimiter c] [--fixed-width n] [--threads n] [--top n] [--type ...] [--match regex] [--region-paths] [--region-depth n] base1.dat [baseX.dat]* -- new1.dat [newX.dat]*\n");
+		fprintf(stderr, "       ./reader --timeseries [--delimiter c] [--fixed-width n] [--region-paths] [--region-depth n] file1.kpsnap [fileX.kpsnap]*\n");
 		exit(-1);
 	}
 
         char delimiter   = ' ';
         int fixed_width  = 0;
+        int percentiles  = 0;
+        int stats        = 0;
+        int region_depth = 0;
+        int timeseries   = 0;
+        int overhead     = 0;
+        int launch_gaps  = 10;
+        int fusion       = 10;
+        double fusion_threshold = 10.0;
+        int threads      = 0;
+        int top          = 0;
+        int sort_imbalance = 0;
+        uint32_t type_mask = ~0u;
+        const char* match = NULL;
+        int diff         = 0;
+        double alpha     = 0.05;
+        const char* export_path = NULL;
 
         int commandline_args = 1;
         while( (commandline_args<argc ) && (argv[commandline_args][0]=='-') ) {
+          if(strcmp(argv[commandline_args],"--")==0) {
+            break;
+          }
           if(strcmp(argv[commandline_args],"--delimiter")==0) {
             delimiter=argv[++commandline_args][0];
           }
           if(strcmp(argv[commandline_args],"--fixed-width")==0) {
             fixed_width=atoi(argv[++commandline_args]);
           }
+          if(strcmp(argv[commandline_args],"--percentiles")==0) {
+            percentiles=1;
+          }
+          if(strcmp(argv[commandline_args],"--stats")==0) {
+            stats=1;
+          }
+          if(strcmp(argv[commandline_args],"--region-paths")==0) {
+            region_depth=-1;
+          }
+          if(strcmp(argv[commandline_args],"--region-depth")==0) {
+            region_depth=atoi(argv[++commandline_args]);
+          }
+          if(strcmp(argv[commandline_args],"--timeseries")==0) {
+            timeseries=1;
+          }
+          if(strcmp(argv[commandline_args],"--overhead")==0) {
+            overhead=1;
+          }
+          if(strcmp(argv[commandline_args],"--launch-gaps")==0) {
+            launch_gaps=atoi(argv[++commandline_args]);
+          }
+          if(strcmp(argv[commandline_args],"--fusion")==0) {
+            fusion=atoi(argv[++commandline_args]);
+          }
+          if(strcmp(argv[commandline_args],"--fusion-threshold")==0) {
+            fusion_threshold=atof(argv[++commandline_args]);
+          }
+          if(strcmp(argv[commandline_args],"--threads")==0) {
+            threads=atoi(argv[++commandline_args]);
+          }
+          if(strcmp(argv[commandline_args],"--top")==0) {
+            top=atoi(argv[++commandline_args]);
+          }
+          if(strcmp(argv[commandline_args],"--sort")==0) {
+            const char* key=argv[++commandline_args];
+            if(strcmp(key,"imbalance")==0) {
+              sort_imbalance=1;
+            } else if(strcmp(key,"time")!=0) {
+              fprintf(stderr, "Unknown sort key %s, expected time or imbalance\n", key);
+              exit(-1);
+            }
+          }
+          if(strcmp(argv[commandline_args],"--type")==0) {
+            type_mask=parse_type_mask(argv[++commandline_args]);
+            if(0 == type_mask) {
+              fprintf(stderr, "Unknown kernel type in %s\n", argv[commandline_args]);
+              exit(-1);
+            }
+          }
+          if(strcmp(argv[commandline_args],"--match")==0) {
+            match=argv[++commandline_args];
+          }
+          if(strcmp(argv[commandline_args],"--diff")==0) {
+            diff=1;
+          }
+          if(strcmp(argv[commandline_args],"--alpha")==0) {
+            alpha=atof(argv[++commandline_args]);
+          }
+          if(strcmp(argv[commandline_args],"--export")==0) {
+            export_path=argv[++commandline_args];
+          }
 
           commandline_args++;
         }
 
-	std::vector<KernelPerformanceInfo*> kernelInfo;
+	std::regex match_regex;
+
+	if(NULL != match) {
+		try {
+			match_regex.assign(match);
+		} catch(const std::regex_error& error) {
+			fprintf(stderr, "Invalid regular expression %s: %s\n", match, error.what());
+			exit(-1);
+		}
+	}
+
+	if(diff) {
+		int separator = commandline_args;
+		while(separator < argc && strcmp(argv[separator], "--") != 0) separator++;
+
+		if(separator == argc) {
+			fprintf(stderr, "Separate the base and the new files with --\n");
+			exit(-1);
+		}
+
+		KernelAggregate* base = read_files(argv + commandline_args, separator - commandline_args,
+			threads, region_depth);
+		KernelAggregate* next = read_files(argv + separator + 1, argc - separator - 1,
+			threads, region_depth);
+
+		return print_diff(*base, *next, top, type_mask, (NULL != match) ? &match_regex : NULL,
+			alpha, delimiter, fixed_width);
+	}
+
+	if(timeseries) {
+		return print_timeseries(argc, argv, commandline_args, delimiter, fixed_width, region_depth);
+	}
+
+	KernelAggregate* aggregate = read_files(argv + commandline_args, argc - commandline_args,
+		threads, region_depth);
+	KernelAggregate& total = *aggregate;
+
 	double totalKernelsTime = 0;
-	double totalExecuteTime = 0;
+	double totalExecuteTime = total.totalExecuteTime;
 	uint64_t totalKernelsCalls = 0;
+	double totalFenceTime = 0;
+	double totalOverhead = 0;
+	double totalDeepCopyTime = 0;
+	uint64_t totalDeepCopyBytes = 0;
+	double totalLaunchGapTime = total.totalLaunchGapTime;
 
-	for(int i = commandline_args; i < argc; i++) {
-		FILE* the_file = fopen(argv[i], "rb");
+	std::vector<KernelPerformanceInfo*> kernelInfo(total.merged.getKernels());
+	std::vector<KernelLaunchGap*> launchGaps;
 
-		double fileExecuteTime = 0;
-		fread(&fileExecuteTime, sizeof(fileExecuteTime), 1, the_file);
-
-		totalExecuteTime += fileExecuteTime;
+	for(auto gap_itr = total.gap_map.begin(); gap_itr != total.gap_map.end(); gap_itr++) {
+		launchGaps.push_back(gap_itr->second);
+	}
 
-		while(! feof(the_file)) {
-			KernelPerformanceInfo* new_kernel = new KernelPerformanceInfo("", PARALLEL_FOR);
-			if(new_kernel->readFromFile(the_file)) {
-			   if(strlen(new_kernel->getName()) > 0) {
-				int kernelIndex = find_index(kernelInfo, new_kernel->getName());
+	// only chains of short kernels, so the table is left out when none is
+	std::vector<KernelChainInfo*> kernelChains;
 
-				if(kernelIndex > -1) {
-					kernelInfo[kernelIndex]->addTime(new_kernel->getTime());
-					kernelInfo[kernelIndex]->addCallCount(new_kernel->getCallCount());
-				} else {
-					kernelInfo.push_back(new_kernel);
-				}
-                           }
-			}
+	for(auto chain_itr = total.chain_map.begin(); chain_itr != total.chain_map.end(); chain_itr++) {
+		if(is_fusion_candidate(chain_itr->second, fusion_threshold * 1.0e-6)) {
+			kernelChains.push_back(chain_itr->second);
 		}
-
-		fclose(the_file);
 	}
 
-	std::sort(kernelInfo.begin(), kernelInfo.end(), compareKernelPerformanceInfo);
+	// kernels keep the names they were merged on, and are demangled as printed
+	DemangleCache demangled;
 
 	for(int i = 0; i < kernelInfo.size(); i++) {
     if(kernelInfo[i]->getKernelType() != REGION) {
+      totalOverhead += kernelInfo[i]->getOverhead();
+    }
+
+    if(kernelInfo[i]->getKernelType() == FENCE) {
+      totalFenceTime += kernelInfo[i]->getTime();
+    } else if(kernelInfo[i]->getKernelType() == DEEP_COPY) {
+      totalDeepCopyTime += kernelInfo[i]->getTime();
+      totalDeepCopyBytes += kernelInfo[i]->getBytes();
+    } else if(kernelInfo[i]->getKernelType() != REGION) {
 		  totalKernelsTime += kernelInfo[i]->getTime();
 		  totalKernelsCalls += kernelInfo[i]->getCallCount();
     }
 	}
 
-  printf("Regions: \n\n");
+	// the summary covers every kernel, the tables only those selected
+	kernelInfo = select_kernels(kernelInfo, top, type_mask, (NULL != match) ? &match_regex : NULL,
+		demangled, sort_imbalance ? compareKernelImbalanceCost : compareKernelPerformanceInfo);
+
+	if(NULL != export_path) {
+		return export_columns(kernelInfo, demangled, totalExecuteTime, export_path);
+	}
+
+  // select_kernels puts regions first; without any the section is left out
+  const bool has_regions = ! kernelInfo.empty() && kernelInfo[0]->getKernelType() == REGION;
+
+  if(has_regions) printf("Regions: \n\n");
 
   for(int i = 0; i < kernelInfo.size(); i++) {
 		const double callCountDouble = (double) kernelInfo[i]->getCallCount();
@@ -139,7 +1267,7 @@ int main(int argc, char* argv[]) {
 		if(kernelInfo[i]->getKernelType() != REGION) continue;
     if(fixed_width)
 		printf("- %100s\n%11s%c%15.5f%c%12" PRIu64 "%c%15.5f%c%7.3f%c%7.3f\n",
-		  kernelInfo[i]->getName(),
+		  demangled.get(kernelInfo[i]->getName()),
 		   ( kernelInfo[i]->getKernelType() == PARALLEL_FOR) ? (
 		     " (ParFor)  " ) : (
 		   ( kernelInfo[i]->getKernelType() == PARALLEL_REDUCE) ? (
@@ -154,7 +1282,7 @@ int main(int argc, char* argv[]) {
 			delimiter,(kernelInfo[i]->getTime() / totalKernelsTime) * 100.0,
 			delimiter,(kernelInfo[i]->getTime() / totalExecuteTime) * 100.0 );
     else
-    printf("- %s\n%s%c%f%c%" PRIu64 "%c%f%c%f%c%f\n", kernelInfo[i]->getName(),
+    printf("- %s\n%s%c%f%c%" PRIu64 "%c%f%c%f%c%f\n", demangled.get(kernelInfo[i]->getName()),
          ( kernelInfo[i]->getKernelType() == PARALLEL_FOR) ? (
            " (ParFor)  " ) : (
          ( kernelInfo[i]->getKernelType() == PARALLEL_REDUCE) ? (
@@ -168,60 +1296,92 @@ int main(int argc, char* argv[]) {
       delimiter,kernelInfo[i]->getTime() / callCountDouble,
       delimiter,(kernelInfo[i]->getTime() / totalKernelsTime) * 100.0,
       delimiter,(kernelInfo[i]->getTime() / totalExecuteTime) * 100.0 );
+
+    print_self_time(kernelInfo[i], delimiter, fixed_width, totalExecuteTime);
+    print_rank_stats(kernelInfo[i], delimiter, fixed_width);
+    print_region_path(kernelInfo[i]);
+    if(percentiles) print_percentiles(kernelInfo[i], delimiter, fixed_width);
+    if(stats) print_stats(kernelInfo[i], delimiter, fixed_width);
+    if(overhead) print_overhead(kernelInfo[i], delimiter, fixed_width);
 	}
 
-  printf("\n");
-  printf("-------------------------------------------------------------------------\n");
+  if(has_regions) {
+    printf("\n");
+    printf("-------------------------------------------------------------------------\n");
+  }
   printf("Kernels: \n\n");
 
   for(int i = 0; i < kernelInfo.size(); i++) {
     const double callCountDouble = (double) kernelInfo[i]->getCallCount();
 
     if(kernelInfo[i]->getKernelType() == REGION) continue;
+
+    // fences and deep copies are a percentage of all fences or all copies
+    const double categoryTime =
+       ( kernelInfo[i]->getKernelType() == FENCE) ? totalFenceTime : (
+       ( kernelInfo[i]->getKernelType() == DEEP_COPY) ? totalDeepCopyTime :
+         totalKernelsTime );
     if(fixed_width)
     printf("- %100s\n%11s%c%15.5f%c%12" PRIu64 "%c%15.5f%c%7.3f%c%7.3f\n",
-      kernelInfo[i]->getName(),
-       ( kernelInfo[i]->getKernelType() == PARALLEL_FOR) ? (
-         " (ParFor)  " ) : (
-       ( kernelInfo[i]->getKernelType() == PARALLEL_REDUCE) ? (
-         " (ParRed)  " ) : (
-       ( kernelInfo[i]->getKernelType() == PARALLEL_SCAN) ? (
-         " (ParScan) " ) : (
-         " (Region)  " )
-       )),
+      demangled.get(kernelInfo[i]->getName()),
+       type_label(kernelInfo[i]->getKernelType()),
       delimiter,kernelInfo[i]->getTime(),
       delimiter,kernelInfo[i]->getCallCount(),
       delimiter,kernelInfo[i]->getTime() / callCountDouble,
-      delimiter,(kernelInfo[i]->getTime() / totalKernelsTime) * 100.0,
+      delimiter,(kernelInfo[i]->getTime() / categoryTime) * 100.0,
       delimiter,(kernelInfo[i]->getTime() / totalExecuteTime) * 100.0 );
     else
-    printf("- %s\n%s%c%f%c%" PRIu64 "%c%f%c%f%c%f\n", kernelInfo[i]->getName(),
-         ( kernelInfo[i]->getKernelType() == PARALLEL_FOR) ? (
-           " (ParFor)  " ) : (
-         ( kernelInfo[i]->getKernelType() == PARALLEL_REDUCE) ? (
-           " (ParRed)  " ) : (
-         ( kernelInfo[i]->getKernelType() == PARALLEL_SCAN) ? (
-           " (ParScan) " ) : (
-           " (REGION)  " )
-         )),
+    printf("- %s\n%s%c%f%c%" PRIu64 "%c%f%c%f%c%f\n", demangled.get(kernelInfo[i]->getName()),
+         type_label(kernelInfo[i]->getKernelType()),
       delimiter,kernelInfo[i]->getTime(),
       delimiter,kernelInfo[i]->getCallCount(),
       delimiter,kernelInfo[i]->getTime() / callCountDouble,
-      delimiter,(kernelInfo[i]->getTime() / totalKernelsTime) * 100.0,
+      delimiter,(kernelInfo[i]->getTime() / categoryTime) * 100.0,
       delimiter,(kernelInfo[i]->getTime() / totalExecuteTime) * 100.0 );
+
+    if(kernelInfo[i]->getKernelType() == DEEP_COPY) print_bandwidth(kernelInfo[i], delimiter, fixed_width);
+    print_sampling(kernelInfo[i], delimiter, fixed_width);
+    print_rank_stats(kernelInfo[i], delimiter, fixed_width);
+    print_region_path(kernelInfo[i]);
+    if(percentiles) print_percentiles(kernelInfo[i], delimiter, fixed_width);
+    if(stats) print_stats(kernelInfo[i], delimiter, fixed_width);
+    if(overhead) print_overhead(kernelInfo[i], delimiter, fixed_width);
   }
 
+	if(launch_gaps > 0 && ! launchGaps.empty()) {
+		printf("\n");
+		printf("-------------------------------------------------------------------------\n");
+		printf("Launch gaps: \n\n");
+
+		print_launch_gaps(launchGaps, launch_gaps, demangled, delimiter, fixed_width, totalExecuteTime);
+	}
+
+	if(fusion > 0 && ! kernelChains.empty()) {
+		printf("\n");
+		printf("-------------------------------------------------------------------------\n");
+		printf("Fusion candidates (kernels under %.3f us per call): \n\n", fusion_threshold);
+
+		print_fusion_candidates(kernelChains, fusion, demangled, delimiter,
+			fixed_width, totalExecuteTime);
+	}
+
 	printf("\n");
 	printf("-------------------------------------------------------------------------\n");
 	printf("Summary:\n");
 	printf("\n");
 	printf("Total Execution Time (incl. Kokkos + non-Kokkos):      %20.5f seconds\n", totalExecuteTime);
 	printf("Total Time in Kokkos kernels:                          %20.5f seconds\n", totalKernelsTime);
-	printf("   -> Time outside Kokkos kernels:                     %20.5f seconds\n",
-		(totalExecuteTime - totalKernelsTime));
+	printf("Total Time in Kokkos fences:                           %20.5f seconds\n", totalFenceTime);
+	printf("Total Time in Kokkos deep copies:                      %20.5f seconds\n", totalDeepCopyTime);
+	printf("   -> Deep copy bandwidth:                             %20.5f GB/s\n",
+		(totalDeepCopyTime > 0) ? totalDeepCopyBytes / totalDeepCopyTime * 1.0e-9 : 0);
+	printf("   -> Time outside Kokkos kernels, fences and copies:  %20.5f seconds\n",
+		(totalExecuteTime - totalKernelsTime - totalFenceTime - totalDeepCopyTime));
 	printf("   -> Percentage in Kokkos kernels:                    %20.2f %%\n",
 		(totalKernelsTime / totalExecuteTime) * 100);
+	printf("   -> Host time between consecutive kernels:           %20.5f seconds\n", totalLaunchGapTime);
 	printf("Total Calls to Kokkos Kernels:                         %20" PRIu64 "\n", totalKernelsCalls);
+	printf("Estimated tool overhead:                               %20.5f seconds\n", totalOverhead);
 	printf("\n");
 	printf("-------------------------------------------------------------------------\n");
 